@@ -0,0 +1,212 @@
+/***************************************************
+ * abcbench - encoder throughput benchmark
+ *
+ * usage: abcbench [<options>]
+ * OPTIONS
+ *         -h             display help and exit
+ *         -n <reps>      runs per case (7)
+ *         -e             also run every case with exact rate (-e)
+ *         -q             quick, only the small inputs
+ *
+ * Every combination of input (synthetic .bas text and .bac binary
+ * of a few sizes), format wav|au|raw|flac, 8|16|24|32 bits, 700|2400
+ * baud and a set of sample rates is encoded reps times into a sink
+ * that throws the samples away. The median and 95th percentile run
+ * time, samples/s and MB/s of each case are written as JSON on stdout.
+ ****************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "abccas.h"
+
+char* progname = "abcbench";
+
+static const int bench_rate[] = { 11200, 22050, 44100, 48000 };
+static const int bench_baud[] = { 700, 2400 };
+static const int bench_bits[] = { 8, 16, 24, 32 };
+static const int bench_format[] = {
+    AUDIO_FORMAT_WAV, AUDIO_FORMAT_AU, AUDIO_FORMAT_RAW, AUDIO_FORMAT_FLAC };
+static const char* bench_format_name[] = { "raw", "wav", "au", "flac" };
+static const size_t bench_size[] = { 4*1024, 64*1024 };
+
+#define NELEMS(a) (sizeof(a)/sizeof((a)[0]))
+
+typedef struct {
+    char* name;      // "bas" | "bac"
+    char* filename;  // tape name, gives the type
+    int konv;
+    size_t len;
+    char* data;
+} bench_input_t;
+
+// count and drop the samples
+static int null_write(void* arg, const void* ptr, size_t len)
+{
+    (void) ptr;
+    *(uint64_t*)arg += len;
+    return 0;
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+// BASIC program text, numbered lines with \n
+static void make_bas(bench_input_t* in, size_t size)
+{
+    static const char* stmt[] = {
+	"PRINT \"HELLO WORLD\"", "A=A+1", "FOR I=1 TO 10", "NEXT I",
+	"IF A>100 THEN 10", "X$=\"ABC80\"", "GOSUB 1000", "RETURN" };
+    size_t len = 0;
+    int line = 10;
+
+    in->name = "bas";
+    in->filename = "bench.bas";
+    in->konv = 1;
+    in->data = malloc(size + 64);
+    while(len < size) {
+	len += sprintf(in->data+len, "%d %s\n", line,
+		       stmt[(line/10) % NELEMS(stmt)]);
+	line += 10;
+    }
+    in->len = size;
+}
+
+// binary, pseudo random bytes
+static void make_bac(bench_input_t* in, size_t size)
+{
+    uint32_t x = 2463534242u;
+    size_t i;
+
+    in->name = "bac";
+    in->filename = "bench.bac";
+    in->konv = 0;
+    in->data = malloc(size);
+    for (i = 0; i < size; i++) {
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+	in->data[i] = x;
+    }
+    in->len = size;
+}
+
+// encode in reps times, print one JSON result object
+static void run_case(bench_input_t* in, int format, int bits, int baud,
+		     int rate, int exact, int reps, int first)
+{
+    abc_encoder_t enc;
+    abc_sink_t sink;
+    uint64_t bytes = 0;
+    double* t;
+    char* buf;
+    int64_t nsamp = 0;
+    double median, p95;
+    int i, r;
+
+    if (exact)
+	r = abc_encoder_init_exact(&enc, format, bits, baud, rate);
+    else
+	r = abc_encoder_init(&enc, format, bits, baud, rate);
+    if (r < 0)
+	return;
+    t = malloc(reps*sizeof(double));
+    buf = malloc(in->len);
+    for (i = 0; i < reps; i++) {
+	size_t len = in->len;
+	double t0 = abc_now();
+
+	memcpy(buf, in->data, len);
+	if (in->konv)
+	    len = abc_konvert_line(buf, len);
+	bytes = 0;
+	abc_sink_callback(&sink, null_write, &bytes);
+	abc_encode(&enc, &sink, in->filename, buf, len);
+	t[i] = abc_now() - t0;
+	if (i == 0)
+	    nsamp = abc_num_samples(&enc, abc_num_blocks(len));
+    }
+    qsort(t, reps, sizeof(double), cmp_double);
+    median = (reps & 1) ? t[reps/2] : (t[reps/2-1] + t[reps/2])/2;
+    p95 = t[(95*reps + 99)/100 - 1];
+
+    printf("%s    {\"input\": \"%s\", \"size\": %ld, \"format\": \"%s\", "
+	   "\"bits\": %d, \"baud\": %d, \"rate\": %d, \"sample_rate\": %d, "
+	   "\"exact\": %d,\n"
+	   "     \"samples\": %ld, \"bytes\": %lu, \"median_s\": %.6f, "
+	   "\"p95_s\": %.6f, \"samples_per_s\": %.0f, \"mb_per_s\": %.1f}",
+	   first ? "" : ",\n",
+	   in->name, in->len, bench_format_name[format],
+	   bits, baud, rate, enc.sample_rate, exact,
+	   nsamp, bytes, median, p95, nsamp/median, bytes/median/1e6);
+    fflush(stdout);
+    free(buf);
+    free(t);
+    abc_encoder_free(&enc);
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: %s [<options>]\n", progname);
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "    -h               help\n");
+    fprintf(stderr, "    -n <reps>        runs per case (7)\n");
+    fprintf(stderr, "    -e               also run with exact rate\n");
+    fprintf(stderr, "    -q               quick, small inputs only\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_input_t in[2*NELEMS(bench_size)];
+    int nin = 0;
+    int reps = 7;
+    int exact = 0;
+    int quick = 0;
+    int first = 1;
+    int opt;
+    int i, f, z, b, r, e;
+
+    while ((opt = getopt(argc, argv, "hn:eq")) != -1) {
+	switch(opt) {
+	case 'n':
+	    if ((reps = atoi(optarg)) < 1)
+		usage();
+	    break;
+	case 'e':
+	    exact = 1;
+	    break;
+	case 'q':
+	    quick = 1;
+	    break;
+	case 'h':
+	default:
+	    usage();
+	}
+    }
+
+    for (i = 0; i < (quick ? 1 : (int) NELEMS(bench_size)); i++) {
+	make_bas(&in[nin++], bench_size[i]);
+	make_bac(&in[nin++], bench_size[i]);
+    }
+
+    printf("{\"bench\": \"abccas\", \"reps\": %d, \"results\": [\n", reps);
+    for (i = 0; i < nin; i++) {
+	for (f = 0; f < (int) NELEMS(bench_format); f++)
+	for (z = 0; z < (int) NELEMS(bench_bits); z++)
+	for (b = 0; b < (int) NELEMS(bench_baud); b++)
+	for (r = 0; r < (int) NELEMS(bench_rate); r++)
+	for (e = 0; e <= exact; e++) {
+	    run_case(&in[i], bench_format[f], bench_bits[z], bench_baud[b],
+		     bench_rate[r], e, reps, first);
+	    first = 0;
+	}
+	fprintf(stderr, "%s: %s %ld done\n", progname, in[i].name, in[i].len);
+    }
+    printf("\n]}\n");
+    exit(0);
+}
@@ -0,0 +1,2174 @@
+/***************************************************
+ * abccas - ABC 80 casette encoder library
+ *
+ * Encoder part of ABCcas - by Robert Juhasz, 2008
+ * Added more stuff 2023 by Tony Rogvall
+ ****************************************************/
+#include <sys/types.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <math.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "abccas.h"
+#include "wav.h"
+#include "au.h"
+#include "flac.h"
+
+//
+// output sqaure wave samples
+// ABC 80  = 700 baud
+// ABC 800 = 700/2400 baud
+//
+//
+// |         |  = 0
+// |         |
+// +----+----+
+//
+// +---------+
+// |         |  = 0
+// |         |
+//
+// |    +----+  = 1
+// |    |    |
+// +----+    +
+//
+// +----+    +  = 1
+// |    |    |
+// +    +----+
+//
+//
+
+static int file_write(abc_sink_t* sink, const void* ptr, size_t len)
+{
+    if (fwrite(ptr, sizeof(uint8_t), len, (FILE*) sink->arg) != len)
+	return -1;
+    return 0;
+}
+
+static int file_seek(abc_sink_t* sink, int64_t pos)
+{
+    return fseeko((FILE*) sink->arg, pos, SEEK_SET);
+}
+
+void abc_sink_file(abc_sink_t* sink, FILE* f)
+{
+    memset(sink, 0, sizeof(abc_sink_t));
+    sink->write = file_write;
+    sink->arg = f;
+    sink->fd = -1;
+    if ((sink->pos = ftello(f)) < 0)
+	sink->pos = 0;
+    else if (fseeko(f, sink->pos, SEEK_SET) == 0)
+	sink->seek = file_seek;
+}
+
+static int fd_write(abc_sink_t* sink, const void* ptr, size_t len)
+{
+    const uint8_t* p = ptr;
+
+    while(len > 0) {
+	ssize_t n = write(sink->fd, p, len);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+static int fd_seek(abc_sink_t* sink, int64_t pos)
+{
+    return (lseek(sink->fd, pos, SEEK_SET) < 0) ? -1 : 0;
+}
+
+void abc_sink_fd(abc_sink_t* sink, int fd)
+{
+    memset(sink, 0, sizeof(abc_sink_t));
+    sink->write = fd_write;
+    sink->fd = fd;
+    if ((sink->pos = lseek(fd, 0, SEEK_CUR)) < 0)
+	sink->pos = 0;
+    else
+	sink->seek = fd_seek;
+}
+
+static int memory_write(abc_sink_t* sink, const void* ptr, size_t len)
+{
+    if (sink->pos + len > sink->size) {
+	size_t size = sink->size ? sink->size : 64*1024;
+	uint8_t* buf;
+
+	if (!sink->grow) {
+	    errno = ENOSPC;
+	    return -1;
+	}
+	while(size < sink->pos + len)
+	    size *= 2;
+	if ((buf = realloc(sink->buf, size)) == NULL)
+	    return -1;
+	sink->buf = buf;
+	sink->size = size;
+    }
+    memcpy(sink->buf + sink->pos, ptr, len);
+    if (sink->pos + len > sink->len)
+	sink->len = sink->pos + len;
+    return 0;
+}
+
+static int memory_seek(abc_sink_t* sink, int64_t pos)
+{
+    if ((pos < 0) || (pos > sink->len)) {
+	errno = EINVAL;
+	return -1;
+    }
+    return 0;
+}
+
+// buf = NULL, the sink allocates and grows the buffer
+void abc_sink_memory(abc_sink_t* sink, void* buf, size_t size)
+{
+    memset(sink, 0, sizeof(abc_sink_t));
+    sink->write = memory_write;
+    sink->seek = memory_seek;
+    sink->fd = -1;
+    sink->buf = buf;
+    sink->size = buf ? size : 0;
+    sink->grow = (buf == NULL);
+}
+
+static int callback_write(abc_sink_t* sink, const void* ptr, size_t len)
+{
+    return sink->callback(sink->arg, ptr, len);
+}
+
+void abc_sink_callback(abc_sink_t* sink, abc_write_t cb, void* arg)
+{
+    memset(sink, 0, sizeof(abc_sink_t));
+    sink->write = callback_write;
+    sink->callback = cb;
+    sink->arg = arg;
+    sink->fd = -1;
+}
+
+void abc_sink_free(abc_sink_t* sink)
+{
+    if (sink->grow)
+	free(sink->buf);
+    sink->buf = NULL;
+    sink->size = sink->len = 0;
+}
+
+static inline int sink_write(abc_sink_t* sink, const void* ptr, size_t len)
+{
+    if (sink->write(sink, ptr, len) < 0)
+	return -1;
+    sink->pos += len;
+    return 0;
+}
+
+// monotonic clock in seconds
+double abc_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+static inline double stats_start(abc_tape_t* tape)
+{
+    return tape->stats ? abc_now() : 0.0;
+}
+
+static inline void stats_stop(abc_tape_t* tape, int stage, double t0)
+{
+    if (tape->stats)
+	tape->stats->time[stage] += abc_now() - t0;
+}
+
+// write through the tape sink and count it
+static inline int tape_write(abc_tape_t* tape, const void* ptr, size_t len)
+{
+    if (tape->stats) {
+	tape->stats->write_calls++;
+	tape->stats->output_bytes += len;
+    }
+    return sink_write(tape->sink, ptr, len);
+}
+
+static int sink_seek(abc_sink_t* sink, int64_t pos)
+{
+    if ((sink->seek == NULL) || (sink->seek(sink, pos) < 0))
+	return -1;
+    sink->pos = pos;
+    return 0;
+}
+
+// Sample kernels. KERNEL() generates the level encoder, the run
+// renderer and the exact mode converter for one sample layout, so the
+// sample size and the stores are constants in every loop.
+// wav: u8, s16le, s24le, s32le  au and raw: s8, s16be, s24be, s32be
+#define STORE_U8(p, x)    ((p)[0] = (x) + 0x80)
+#define STORE_S8(p, x)    ((p)[0] = (x))
+#define STORE_S16LE(p, x) ((p)[0] = (x), (p)[1] = (x) >> 8)
+#define STORE_S16BE(p, x) ((p)[0] = (x) >> 8, (p)[1] = (x))
+#define STORE_S24LE(p, x) ((p)[0] = (x), (p)[1] = (x) >> 8, (p)[2] = (x) >> 16)
+#define STORE_S24BE(p, x) ((p)[0] = (x) >> 16, (p)[1] = (x) >> 8, (p)[2] = (x))
+#define STORE_S32LE(p, x) ((p)[0] = (x), (p)[1] = (x) >> 8, \
+			   (p)[2] = (x) >> 16, (p)[3] = (x) >> 24)
+#define STORE_S32BE(p, x) ((p)[0] = (x) >> 24, (p)[1] = (x) >> 16, \
+			   (p)[2] = (x) >> 8, (p)[3] = (x))
+
+// f*max rounded to nearest, moved up to be positive and truncated
+#define SCALE_SAMPLE(f, max) \
+    ((int32_t) ((int64_t) ((double) (f)*(max) + 2147483648.5) - 2147483648LL))
+
+struct abc_kernel {
+    int sample_size;
+    void (*level)(float f, sample_t* s);
+    void (*put)(const float* v, size_t n, uint8_t* out);
+    uint8_t* (*runs)(abc_encoder_t* enc, abc_timeline_t* tl, int lo,
+		     int bx, size_t pos, size_t end, uint8_t* out);
+    void (*weave)(const uint8_t* in, size_t n, size_t stride, uint8_t* out);
+};
+
+#define KERNEL(name, size, max, store)					\
+static void level_##name(float f, sample_t* s)				\
+{									\
+    int32_t x = SCALE_SAMPLE(f, max);					\
+    store(s->data, x);							\
+}									\
+									\
+static void put_##name(const float* v, size_t n, uint8_t* p)		\
+{									\
+    size_t i;								\
+    for (i = 0; i < n; i++, p += size) {				\
+	int32_t x = SCALE_SAMPLE(v[i], max);				\
+	store(p, x);							\
+    }									\
+}									\
+									\
+/* samples from pos to end, edge lo is the next edge and bx the level */ \
+static uint8_t* runs_##name(abc_encoder_t* enc, abc_timeline_t* tl,	\
+			    int lo, int bx, size_t pos, size_t end,	\
+			    uint8_t* out)				\
+{									\
+    size_t hbitsz = enc->hbitsz;					\
+    size_t wlen = (enc->bitsz*size + 23) / 24;				\
+    size_t wsamp = (wlen*24 + size - 1) / size;				\
+    uint8_t pat[2][24];							\
+    size_t k;								\
+									\
+    for (k = 0; k < 24; k += size) {					\
+	memcpy(pat[0]+k, enc->wl.data, size);				\
+	memcpy(pat[1]+k, enc->wh.data, size);				\
+    }									\
+    /* runs between edges are one or two half bits, write a whole bit */ \
+    /* at every edge and let the next run overwrite the rest */		\
+    while((lo < tl->nedges) && (pos + wsamp <= end)) {			\
+	size_t next = tl->edge[lo]*hbitsz;				\
+	for (k = 0; k < wlen; k++)					\
+	    memcpy(out + 24*k, pat[bx], 24);				\
+	out += (next - pos)*size;					\
+	pos = next;							\
+	bx = !bx;							\
+	lo++;								\
+    }									\
+    while(pos < end) {							\
+	size_t next = (lo < tl->nedges) ? tl->edge[lo]*hbitsz : end;	\
+	size_t n;							\
+	if (next > end)							\
+	    next = end;							\
+	for (n = (next - pos)*size; n >= 24; n -= 24, out += 24)	\
+	    memcpy(out, pat[bx], 24);					\
+	memcpy(out, pat[bx], n);					\
+	out += n;							\
+	pos = next;							\
+	bx = !bx;							\
+	lo++;								\
+    }									\
+    return out;								\
+}									\
+									\
+/* n mono samples into one channel of interleaved frames */		\
+static void weave_##name(const uint8_t* in, size_t n, size_t stride,	\
+			 uint8_t* out)					\
+{									\
+    size_t i;								\
+    for (i = 0; i < n; i++, in += size, out += stride)			\
+	memcpy(out, in, size);						\
+}									\
+									\
+static const struct abc_kernel kernel_##name = {			\
+    size, level_##name, put_##name, runs_##name, weave_##name		\
+};
+
+KERNEL(u8,    1, 0x7f,       STORE_U8)
+KERNEL(s8,    1, 0x7f,       STORE_S8)
+KERNEL(s16le, 2, 0x7fff,     STORE_S16LE)
+KERNEL(s16be, 2, 0x7fff,     STORE_S16BE)
+KERNEL(s24le, 3, 0x7fffff,   STORE_S24LE)
+KERNEL(s24be, 3, 0x7fffff,   STORE_S24BE)
+KERNEL(s32le, 4, 0x7fffffff, STORE_S32LE)
+KERNEL(s32be, 4, 0x7fffffff, STORE_S32BE)
+
+static const struct abc_kernel* find_kernel(int audio_format, int bits)
+{
+    int wav = (audio_format == AUDIO_FORMAT_WAV);
+
+    switch(bits) {
+    case 8:  return wav ? &kernel_u8 : &kernel_s8;
+    case 16: return wav ? &kernel_s16le : &kernel_s16be;
+    case 24: return wav ? &kernel_s24le : &kernel_s24be;
+    case 32: return wav ? &kernel_s32le : &kernel_s32be;
+    default: return NULL;
+    }
+}
+
+// phase after each byte, a bit toggles the level once and a "1"
+// toggles it again, so a byte flips the phase when it has odd parity
+static void init_bytes(abc_encoder_t* enc)
+{
+    int bx0, b, i, bx;
+
+    for (bx0 = 0; bx0 < 2; bx0++) {
+	for (b = 0; b < 256; b++) {
+	    bx = bx0;
+	    for (i = 0; i < 8; i++) {
+		bx = !bx;
+		if (b & (1 << i)) // send "1"
+		    bx = !bx;
+	    }
+	    enc->byte_phase[(bx0 << 8) | b] = bx;
+	}
+    }
+}
+
+// rate is adjusted to an even number of samples per bit
+int abc_encoder_init(abc_encoder_t* enc, int audio_format,
+		     int bits_per_channel, int baud, int rate)
+{
+    int br;
+
+    memset(enc, 0, sizeof(abc_encoder_t));
+    if ((enc->kernel = find_kernel(audio_format, bits_per_channel)) == NULL) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (baud <= 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    br = (rate+baud-1)/baud;
+    if (br & 1) br++;           // make even
+    enc->hbitsz = br/2;         // half bit size
+    enc->bitsz  = enc->hbitsz*2;  // bitsize
+    enc->sample_rate = br*baud; // adjust rate
+    enc->baud = baud;
+    if ((enc->hbitsz < 1) || (enc->hbitsz > MAX_HBITSZ)) {
+	errno = ERANGE;
+	return -1;
+    }
+    enc->audio_format = audio_format;
+    enc->bits_per_channel = bits_per_channel;
+    enc->num_channels = DEFAULT_NUM_CHANNELS;
+    enc->leader = LEADER_SIZE;
+    enc->gap = LEADER_SIZE;
+    enc->frame_size = enc->kernel->sample_size*enc->num_channels;
+    enc->kernel->level(LOW_LEVEL, &enc->wl);
+    enc->kernel->level(HIGH_LEVEL, &enc->wh);
+    init_bytes(enc);
+    return 0;
+}
+
+// Band limited step: the integral of a Blackman windowed sinc with
+// the cutoff a bit below nyquist. The output is delayed by BLEP_WIDTH
+// samples so an edge at p only changes samples after p, entry
+// [ph][j] is the step at sample floor(p)+1+j for p = floor(p)+ph/PHASES.
+static void init_blep(abc_encoder_t* enc)
+{
+    const int n = 2*BLEP_WIDTH*BLEP_PHASES;
+    const double fc = 0.9;
+    double* step;
+    double sum = 0.0;
+    int i, ph, j;
+
+    step = malloc((n+1)*sizeof(double));
+    step[0] = 0.0;
+    for (i = 0; i < n; i++) {  // midpoint rule on a 1/PHASES grid
+	double u = (i + 0.5)/BLEP_PHASES - BLEP_WIDTH;
+	double x = M_PI*fc*u;
+	double h = (x == 0.0) ? fc : fc*sin(x)/x;
+	h *= 0.42 + 0.5*cos(M_PI*u/BLEP_WIDTH) +
+	    0.08*cos(2*M_PI*u/BLEP_WIDTH);
+	sum += h;
+	step[i+1] = sum;
+    }
+    for (ph = 0; ph < BLEP_PHASES; ph++) {
+	for (j = 0; j < 2*BLEP_WIDTH; j++)
+	    enc->blep[ph][j] = step[(j+1)*BLEP_PHASES - ph] / sum;
+    }
+    free(step);
+}
+
+// keep the sample rate, edges are placed between samples and
+// rendered as band limited steps
+int abc_encoder_init_exact(abc_encoder_t* enc, int audio_format,
+			   int bits_per_channel, int baud, int rate)
+{
+    if (abc_encoder_init(enc, audio_format, bits_per_channel,
+			 baud, rate) < 0)
+	return -1;
+    if (rate < 2*baud) {  // at least a sample per half bit
+	errno = ERANGE;
+	return -1;
+    }
+    if (audio_format == AUDIO_FORMAT_FLAC) {  // edges are not on samples
+	errno = EINVAL;
+	return -1;
+    }
+    enc->exact = 1;
+    enc->sample_rate = rate;
+    enc->hbitsz = rate/(2*baud);
+    enc->bitsz = enc->hbitsz*2;
+    enc->level[0] = LOW_LEVEL;
+    enc->level[1] = HIGH_LEVEL;
+    init_blep(enc);
+    return 0;
+}
+
+// zero bytes before the first block and before each later block
+int abc_encoder_set_leader(abc_encoder_t* enc, int leader, int gap)
+{
+    if ((leader < 1) || (leader > MAX_LEADER) ||
+	(gap < 1) || (gap > MAX_LEADER)) {
+	errno = ERANGE;
+	return -1;
+    }
+    enc->leader = leader;
+    enc->gap = gap;
+    return 0;
+}
+
+void abc_encoder_free(abc_encoder_t* enc)
+{
+    (void) enc;
+}
+
+// number of blocks to transmit len bytes, name block included
+int64_t abc_num_blocks(size_t len)
+{
+    return 1 + (len + BLOCK_DATA_SIZE - 1) / BLOCK_DATA_SIZE;
+}
+
+// first sample at or after half bit time t, in exact mode the signal
+// is delayed BLEP_WIDTH samples and the tape start is padded with it
+static inline int64_t half_bit_sample(abc_encoder_t* enc, int64_t t)
+{
+    int64_t den = 2*enc->baud;
+    int64_t n = (t*enc->sample_rate + den - 1) / den;
+    if (enc->exact && (t > 0))
+	n += BLEP_WIDTH;
+    return n;
+}
+
+// framed length of block blk on the tape
+size_t abc_frame_len(abc_encoder_t* enc, int64_t blk)
+{
+    return (blk ? enc->gap : enc->leader) + FRAME_BLOCK_SIZE;
+}
+
+// half bit time where block blk starts
+int64_t abc_block_time(abc_encoder_t* enc, int64_t blk)
+{
+    if (blk == 0)
+	return 0;
+    return 16*(abc_frame_len(enc, 0) + (blk-1)*abc_frame_len(enc, 1));
+}
+
+// number of samples (frames) for numblk blocks
+int64_t abc_num_samples(abc_encoder_t* enc, int64_t numblk)
+{
+    return half_bit_sample(enc, abc_block_time(enc, numblk));
+}
+
+void abc_tape_init(abc_tape_t* tape, abc_encoder_t* enc, abc_sink_t* sink)
+{
+    memset(tape, 0, sizeof(abc_tape_t));
+    tape->enc = enc;
+    tape->sink = sink;
+    memcpy(tape->name, "TESTTT  ", sizeof(tape->name));
+    memcpy(tape->ext, "BAC", sizeof(tape->ext));
+    tape->bx = 1;
+    tape->hdrpos = sink ? sink->pos : 0;
+    tape->ds64 = -1;
+}
+
+// tape name and type from the filename, konv is set for text files
+// 1 if the file is text to konvert, .bas or an unknown extension
+int abc_konv_name(const char* filename)
+{
+    const char* ptr;
+
+    if ((ptr = strrchr(filename, '.')) == NULL)
+	return 0;
+    return (strcasecmp(ptr, ".bac") != 0);
+}
+
+void abc_tape_set_name(abc_tape_t* tape, const char* filename, int* konv)
+{
+    const char* ptr;
+    const char* fptr;
+    int i;
+
+    if ((ptr = strrchr(filename, '.')) != NULL) {
+	if (strcasecmp(ptr, ".bas") == 0)
+	    memcpy(tape->ext, "BAS", 3);
+	else
+	    memcpy(tape->ext, "BAC", 3);  // default!
+    }
+    if (konv && abc_konv_name(filename))
+	*konv = 1;
+    if ((fptr = strrchr(filename, '/')) == NULL)
+	fptr = filename;
+    else
+	fptr++;
+    // set casette file name from real filename
+    memset(tape->name, ' ', 8);
+    for (i = 0; (fptr[i] != '\0') && (fptr[i] != '.') && (i < 8); i++)
+	tape->name[i] = toupper(fptr[i]);
+}
+
+#define WAV_DS64_SIZE 28  // riff size, data size, sample count, table
+
+// RIFF length of a wav file of numsamp samples, the ds64 (or JUNK)
+// chunk included when ds64 is set
+static int64_t wav_length(abc_encoder_t* enc, int64_t numsamp,
+			  int64_t trailer, int ds64)
+{
+    // "WAVE" + "ds64" chunk + "fmt " chunk + "data" chunk
+    return 4 + (ds64 ? 8 + WAV_DS64_SIZE : 0) +
+	(8 + sizeof(wav_header_t)) + 8 + numsamp*enc->frame_size + trailer;
+}
+
+// With ds64 set there is a chunk after "WAVE" that is JUNK while the
+// sizes fit in 32 bits, and the ds64 chunk of an RF64 file when not.
+static size_t wav_header(abc_encoder_t* enc, int64_t numsamp,
+			 int64_t trailer, int ds64, uint8_t* ptr)
+{
+    uint8_t* ptr0 = ptr;
+    int64_t totlen;
+    int64_t datalen;
+    int rf64;
+    wav_header_t wav;
+
+    if (numsamp < 0) {
+	totlen = 0xffffffff;
+	datalen = 0xffffffff;
+    }
+    else {
+	datalen = numsamp*enc->frame_size;
+	totlen = wav_length(enc, numsamp, trailer, ds64);
+    }
+    rf64 = ds64 && (totlen > 0xffffffff);
+    ptr = put_tag(ptr, rf64 ? WAV_ID_RF64 : WAV_ID_RIFF);
+    ptr = put_u32le(ptr, (totlen > 0xffffffff) ? 0xffffffff : totlen);
+    ptr = put_tag(ptr, WAV_ID_WAVE);
+    if (ds64) {
+	ptr = put_tag(ptr, rf64 ? WAV_ID_DS64 : WAV_ID_JUNK);
+	ptr = put_u32le(ptr, WAV_DS64_SIZE);
+	if (rf64) {
+	    ptr = put_u64le(ptr, totlen);
+	    ptr = put_u64le(ptr, datalen);
+	    ptr = put_u64le(ptr, numsamp);
+	    ptr = put_u32le(ptr, 0);  // no table
+	}
+	else {
+	    memset(ptr, 0, WAV_DS64_SIZE);
+	    ptr += WAV_DS64_SIZE;
+	}
+    }
+    ptr = put_tag(ptr, WAV_ID_FMT);
+    ptr = put_u32le(ptr, sizeof(wav_header_t));
+
+    wav.AudioFormat = WAVE_FORMAT_PCM;   // PCM
+    wav.NumChannels = enc->num_channels; // Mono=1 | Stereo=2
+    wav.SampleRate  = enc->sample_rate;  // Sample Rate (Binary, in Hz)
+    wav.ByteRate    = enc->sample_rate*enc->frame_size; // Byte Rate
+    wav.FrameSize   = enc->frame_size;
+    wav.BitsPerChannel = enc->bits_per_channel;
+    ptr = put_wav_header(ptr, &wav);
+
+    // "data" + length:32 + data...
+    ptr = put_tag(ptr, WAV_ID_DATA);
+    ptr = put_u32le(ptr, (datalen > 0xffffffff) ? 0xffffffff : datalen);
+    return ptr - ptr0;
+}
+
+static ssize_t au_header(abc_encoder_t* enc, int64_t numsamp, uint8_t* ptr)
+{
+    uint8_t* ptr0 = ptr;
+    au_header_t au;
+
+    au.magic = AU_MAGIC;
+    au.data_offset = 28;   // minimum
+    if ((numsamp < 0) || (numsamp*enc->frame_size > 0xfffffffe))
+	au.data_size = 0xffffffff;  // unknown
+    else
+	au.data_size = numsamp*enc->frame_size;
+    switch(enc->bits_per_channel) {
+    case 8:  au.encoding = AU_ENCODING_LINEAR_8; break;
+    case 16: au.encoding = AU_ENCODING_LINEAR_16; break;
+    case 24: au.encoding = AU_ENCODING_LINEAR_24; break;
+    case 32: au.encoding = AU_ENCODING_LINEAR_32; break;
+    default:
+	errno = EINVAL;
+	return -1;
+    }
+    au.sample_rate = enc->sample_rate;
+    au.channels    = enc->num_channels;
+    memcpy(au.annot, "ABC", 4);
+    ptr = put_au_header(ptr, &au);
+    return ptr - ptr0;
+}
+
+// FLAC frames are built straight from the edge timeline. With at
+// least FLAC_MIN_BLOCK samples per half bit every run between two
+// edges is a frame of its own with a CONSTANT subframe. Otherwise a
+// block is cut into FLAC_BLOCK sample frames with a FIXED order 1
+// subframe, its residual is zero except at the edges.
+#define FLAC_BLOCK     4096
+#define FLAC_MIN_BLOCK 16
+#define FLAC_MAX_FRAME (4*(FLAC_BLOCK+FLAC_MIN_BLOCK) + 32)  // verbatim
+
+static void flac_blocksizes(abc_encoder_t* enc, uint16_t* min, uint16_t* max)
+{
+    if (enc->hbitsz >= FLAC_MIN_BLOCK) {  // runs are one or two half bits
+	*min = enc->hbitsz;
+	*max = enc->bitsz;
+    }
+    else {  // the last frame of a block takes up to FLAC_MIN_BLOCK-1 more
+	*min = FLAC_MIN_BLOCK;
+	*max = FLAC_BLOCK + FLAC_MIN_BLOCK - 1;
+    }
+}
+
+static size_t flac_header(abc_encoder_t* enc, int64_t numsamp, uint8_t* ptr)
+{
+    flac_streaminfo_t si;
+
+    memset(&si, 0, sizeof(si));
+    flac_blocksizes(enc, &si.min_blocksize, &si.max_blocksize);
+    si.sample_rate = enc->sample_rate;
+    si.channels = enc->num_channels;
+    si.bits_per_sample = enc->bits_per_channel;
+    if (numsamp > 0)
+	si.total_samples = numsamp;  // 0 = unknown
+    return put_flac_streaminfo(ptr, &si) - ptr;
+}
+
+static int write_header(abc_tape_t* tape, int64_t numsamp)
+{
+    uint8_t hdr[128];
+    ssize_t len;
+
+    tape->hdrpos = tape->sink->pos;
+    switch(tape->enc->audio_format) {
+    case AUDIO_FORMAT_WAV:
+	len = wav_header(tape->enc, numsamp, tape->trailer, tape->ds64, hdr);
+	break;
+    case AUDIO_FORMAT_AU:
+	if ((len = au_header(tape->enc, numsamp, hdr)) < 0)
+	    return -1;
+	break;
+    case AUDIO_FORMAT_FLAC:
+	len = flac_header(tape->enc, numsamp, hdr);
+	break;
+    default:
+	return 0;
+    }
+    return tape_write(tape, hdr, len);
+}
+
+// write audio header, numsamp = -1 when length is not known (yet).
+// A wav header gets room for RF64 sizes when the data does not fit in
+// 32 bits or, unless tape->ds64 is already 0, when it is not known.
+int abc_write_header(abc_tape_t* tape, int64_t numsamp)
+{
+    double t0 = stats_start(tape);
+    int r;
+
+    if (numsamp >= 0)
+	tape->ds64 = (wav_length(tape->enc, numsamp, tape->trailer, 0) >
+		      0xffffffff);
+    else if (tape->ds64 < 0)
+	tape->ds64 = 1;
+    r = write_header(tape, numsamp);
+
+    stats_stop(tape, ABC_STAGE_HEADER, t0);
+    return r;
+}
+
+// rewrite the header with the lengths of the blocks sent so far,
+// sinks that can not seek are left as is
+int abc_patch_header(abc_tape_t* tape)
+{
+    abc_sink_t* sink = tape->sink;
+    int64_t pos = sink->pos;
+    int64_t hdrpos = tape->hdrpos;
+    int64_t numsamp = abc_num_samples(tape->enc, tape->nblocks);
+    double t0;
+    int r;
+
+    if ((sink->seek == NULL) || (tape->enc->audio_format == AUDIO_FORMAT_RAW))
+	return 0;
+    t0 = stats_start(tape);
+    if ((r = sink_seek(sink, hdrpos)) == 0) {
+	if ((r = write_header(tape, numsamp)) == 0)
+	    r = sink_seek(sink, pos);
+    }
+    stats_stop(tape, ABC_STAGE_HEADER, t0);
+    return r;
+}
+
+static const char* stage_name[ABC_NUM_STAGES] = {
+    "read", "konvert", "frame", "render", "header", "write", "flush",
+    "verify"
+};
+
+void abc_stats_add(abc_stats_t* dst, abc_stats_t* src)
+{
+    int i;
+
+    for (i = 0; i < ABC_NUM_STAGES; i++)
+	dst->time[i] += src->time[i];
+    dst->wall += src->wall;
+    dst->input_bytes += src->input_bytes;
+    dst->output_bytes += src->output_bytes;
+    dst->samples += src->samples;
+    dst->blocks += src->blocks;
+    dst->write_calls += src->write_calls;
+    dst->files += src->files;
+}
+
+// JSON report, bound tells if reading and writing or konvert,
+// framing and rendering took the most time
+void abc_stats_report(abc_stats_t* stats, FILE* f)
+{
+    double io = stats->time[ABC_STAGE_READ] + stats->time[ABC_STAGE_HEADER] +
+	stats->time[ABC_STAGE_WRITE] + stats->time[ABC_STAGE_FLUSH];
+    double cpu = stats->time[ABC_STAGE_KONVERT] +
+	stats->time[ABC_STAGE_FRAME] + stats->time[ABC_STAGE_RENDER] +
+	stats->time[ABC_STAGE_VERIFY];
+    double wall = (stats->wall > 0.0) ? stats->wall : io + cpu;
+    int i;
+
+    fprintf(f, "{\"stages\": {");
+    for (i = 0; i < ABC_NUM_STAGES; i++)
+	fprintf(f, "%s\"%s\": %.6f", i ? ", " : "", stage_name[i],
+		stats->time[i]);
+    fprintf(f, "},\n");
+    fprintf(f, " \"wall_s\": %.6f, \"files\": %lu, \"input_bytes\": %lu, "
+	    "\"output_bytes\": %lu,\n", wall, stats->files,
+	    stats->input_bytes, stats->output_bytes);
+    fprintf(f, " \"blocks\": %lu, \"samples\": %lu, \"write_calls\": %lu, ",
+	    stats->blocks, stats->samples, stats->write_calls);
+    fprintf(f, "\"samples_per_s\": %.0f, \"mb_per_s\": %.1f, "
+	    "\"bound\": \"%s\"}\n",
+	    (wall > 0.0) ? stats->samples/wall : 0.0,
+	    (wall > 0.0) ? stats->output_bytes/wall/1e6 : 0.0,
+	    (io > cpu) ? "io" : "render");
+}
+
+uint16_t abc_checksum16(uint8_t* ptr, size_t len)
+{
+    uint16_t csum = 0;
+    while(len--)
+	csum += *ptr++;
+    return csum;
+}
+
+// frame the block after leader 0 bytes, return the frame length
+size_t abc_frame_block(uint8_t* buf, int leader, uint8_t* frame)
+{
+    uint16_t csum;
+
+    memset(frame, 0, leader);          // 32 0 bytes (default)
+    frame += leader;
+    memset(frame, SYNC, 3);            // 3 sync bytes 16H
+    frame[3] = STX;
+    memcpy(frame+4, buf, 256);         // the block
+    frame[260] = ETX;
+
+    // calculate the checksum
+    csum = abc_checksum16(buf, 256);
+    // csum includes ETX char!!! (as correctly stated in Mikrodatorns ABC)
+    csum += ETX;
+    frame[261] = csum;                 // little endian
+    frame[262] = csum >> 8;
+    return leader + FRAME_BLOCK_SIZE;
+}
+
+static void timeline_start(abc_timeline_t* tl, int bx, int64_t t0)
+{
+    tl->t0 = t0;
+    tl->bx = bx;
+    tl->nhalf = 0;
+    tl->nedges = 0;
+}
+
+// append the edges of len framed bytes
+static void timeline_bytes(abc_timeline_t* tl, const uint8_t* ptr,
+			   size_t len)
+{
+    uint16_t* edge = tl->edge + tl->nedges;
+    unsigned t = tl->nhalf;
+    int i;
+
+    if (len > MAX_FRAME_SIZE - t/16)
+	len = MAX_FRAME_SIZE - t/16;
+    while(len--) {
+	unsigned b = *ptr++;
+	for (i = 0; i < 8; i++) {  // no branch on the data bits
+	    edge[0] = t;            // toggle
+	    edge[1] = t+1;          // kept when sending "1"
+	    edge += 1 + (b & 1);
+	    b >>= 1;
+	    t += 2;
+	}
+    }
+    tl->nhalf = t;
+    tl->nedges = edge - tl->edge;
+}
+
+static int timeline_end(abc_timeline_t* tl)
+{
+    tl->bx_end = tl->bx ^ (tl->nedges & 1);
+    return tl->bx_end;
+}
+
+// edge timeline of len framed bytes starting in phase bx,
+// return the end phase
+int abc_timeline_build(abc_timeline_t* tl, const uint8_t* frame,
+		       size_t len, int bx, int64_t t0)
+{
+    timeline_start(tl, bx, t0);
+    timeline_bytes(tl, frame, len);
+    return timeline_end(tl);
+}
+
+// samples are expanded from the timeline a chunk at a time
+#define RENDER_CHUNK_SIZE (16*1024)
+
+// sample value of level bx, as the kernels store it
+static int32_t flac_level(abc_encoder_t* enc, int bx)
+{
+    float f = bx ? HIGH_LEVEL : LOW_LEVEL;
+    int64_t max = (1LL << (enc->bits_per_channel-1)) - 1;
+
+    return SCALE_SAMPLE(f, max);
+}
+
+// frame header of n samples from sample pos, crc-8 included
+static uint8_t* flac_frame_header(uint8_t* ptr, int64_t pos, size_t n)
+{
+    uint8_t* ptr0 = ptr;
+    int small = (n <= 256);
+
+    ptr = put_u16be(ptr, FLAC_SYNC_VARIABLE);
+    *ptr++ = ((small ? FLAC_BLOCKSIZE_8 : FLAC_BLOCKSIZE_16) << 4) |
+	FLAC_RATE_STREAMINFO;
+    *ptr++ = (FLAC_CHANNEL_MONO << 4) | (FLAC_BITS_STREAMINFO << 1);
+    ptr = put_flac_number(ptr, pos);
+    if (small)
+	*ptr++ = n-1;
+    else
+	ptr = put_u16be(ptr, n-1);
+    *ptr = flac_crc8(ptr0, ptr - ptr0);
+    return ptr+1;
+}
+
+// pad the subframe and add the crc-16 of the frame
+static uint8_t* flac_frame_end(flac_bits_t* bw, uint8_t* frame)
+{
+    uint8_t* ptr = flac_align(bw);
+    return put_u16be(ptr, flac_crc16(frame, ptr - frame));
+}
+
+// bits of a partition of m residuals with nup rising and ndown falling
+// edges (zigzag zup and zup-1) for the best rice parameter *kp
+static uint64_t flac_rice_cost(size_t m, int nup, int ndown, uint32_t zup,
+			       int* kp)
+{
+    uint64_t best = ~0ULL;
+    int k;
+
+    *kp = 0;
+    if (nup + ndown == 0)
+	return m;
+    for (k = 0; k <= FLAC_RICE2_MAX_PARAM; k++) {
+	uint64_t c = (uint64_t) m*(k+1) + (uint64_t) nup*(zup >> k) +
+	    (uint64_t) ndown*((zup-1) >> k);
+	if (c >= best)  // the cost falls to one minimum and rises
+	    break;
+	best = c;
+	*kp = k;
+    }
+    return best;
+}
+
+// bits of the residual with partition order p, parameters to param
+static uint64_t flac_residual_cost(size_t n, int p, const uint16_t* edge,
+				   int ne, int bx, uint32_t zup, int* param)
+{
+    size_t ps = n >> p;
+    uint64_t bits = 2 + 4;  // method, order
+    int i = 0, j;
+
+    for (j = 0; j < (1 << p); j++) {
+	size_t end = (j+1)*ps;
+	int nup = 0, ndown = 0;
+	for (; (i < ne) && (edge[i] < end); i++) {
+	    if (bx ^ !(i & 1))  // level after inner edge i
+		nup++;
+	    else
+		ndown++;
+	}
+	bits += 5 + flac_rice_cost(j ? ps : ps-1, nup, ndown, zup, &param[j]);
+    }
+    return bits;
+}
+
+// n samples from pos starting at level bx with ne level changes at
+// sample offsets edge[] (0 < edge[i] < n). Flat frames are CONSTANT,
+// others FIXED order 1 unless the residual is larger than VERBATIM
+// (or does not fit in 32 bits).
+static uint8_t* flac_frame(abc_encoder_t* enc, uint8_t* ptr, int64_t pos,
+			   size_t n, int bx, const uint16_t* edge, int ne,
+			   const int32_t* lv)
+{
+    int bits = enc->bits_per_channel;
+    uint32_t zup = 2*(uint32_t) (lv[1] - lv[0]);  // zigzag of a rising edge
+    int param[1 << FLAC_MAX_PARTITION_ORDER];
+    uint64_t best = (uint64_t) n*bits;
+    uint8_t* frame = ptr;
+    flac_bits_t bw;
+    size_t s;
+    int p, bestp = -1, i, j;
+
+    if ((ne > 0) && (bits <= 24)) {
+	for (p = 0; (p <= FLAC_MAX_PARTITION_ORDER) &&
+		 ((n & ((1 << p) - 1)) == 0) && ((n >> p) > 1); p++) {
+	    uint64_t c = bits + flac_residual_cost(n, p, edge, ne, bx, zup,
+						   param);
+	    if (c < best) {
+		best = c;
+		bestp = p;
+	    }
+	}
+    }
+    bw.ptr = flac_frame_header(ptr, pos, n);
+    bw.acc = 0;
+    bw.nbits = 0;
+    if (ne == 0) {
+	flac_put_bits(&bw, FLAC_SUBFRAME_CONSTANT, 8);
+	flac_put_bits(&bw, lv[bx], bits);
+    }
+    else if (bestp < 0) {
+	size_t size = enc->kernel->sample_size;
+
+	// byte aligned big endian samples, the layout of wl and wh
+	flac_put_bits(&bw, FLAC_SUBFRAME_VERBATIM, 8);
+	for (s = 0, i = 0; s < n; s++, bw.ptr += size) {
+	    if ((i < ne) && (edge[i] == s)) {
+		bx = !bx;
+		i++;
+	    }
+	    memcpy(bw.ptr, bx ? enc->wh.data : enc->wl.data, size);
+	}
+    }
+    else {
+	size_t ps = n >> bestp;
+
+	flac_residual_cost(n, bestp, edge, ne, bx, zup, param);
+	flac_put_bits(&bw, FLAC_SUBFRAME_FIXED | (1 << 1), 8);
+	flac_put_bits(&bw, lv[bx], bits);  // warm up sample
+	flac_put_bits(&bw, FLAC_RESIDUAL_RICE2, 2);
+	flac_put_bits(&bw, bestp, 4);
+	for (j = 0, s = 1, i = 0; j < (1 << bestp); j++) {
+	    int k = param[j];
+	    size_t end = (j+1)*ps;
+
+	    flac_put_bits(&bw, k, 5);
+	    while(s < end) {
+		size_t next = (i < ne) ? edge[i] : n;
+		if (next > end)
+		    next = end;
+		// zero residuals, a stop bit and k zero bits each, as
+		// many as fit in 32 bits at a time
+		if (s < next) {
+		    int m = 32/(k+1), c;
+		    uint32_t w = 0;
+		    for (c = 0; c < m; c++)
+			w = (w << (k+1)) | (1 << k);
+		    for (; s + m <= next; s += m)
+			flac_put_bits(&bw, w, m*(k+1));
+		    flac_put_bits(&bw, w, (next - s)*(k+1));
+		    s = next;
+		}
+		if ((s < end) && (i < ne)) {  // edge
+		    uint32_t z;
+		    uint32_t q;
+		    bx = !bx;
+		    z = bx ? zup : zup-1;
+		    for (q = z >> k; q >= 32; q -= 32)
+			flac_put_bits(&bw, 0, 32);
+		    flac_put_bits(&bw, 1, q+1);
+		    flac_put_bits(&bw, z, k);
+		    s++;
+		    i++;
+		}
+	    }
+	}
+    }
+    return flac_frame_end(&bw, frame);
+}
+
+// FLAC frames of one block, no samples are rendered
+static int flac_block(abc_tape_t* tape, abc_timeline_t* tl)
+{
+    abc_encoder_t* enc = tape->enc;
+    uint8_t out[2*RENDER_CHUNK_SIZE];
+    uint16_t edge[FLAC_BLOCK+FLAC_MIN_BLOCK];
+    int64_t pos0 = half_bit_sample(enc, tl->t0);
+    size_t n = abc_timeline_samples(enc, tl);
+    size_t hbitsz = enc->hbitsz;
+    size_t s, len;
+    uint8_t* ptr = out;
+    int32_t lv[2];
+    int bx = tl->bx;
+    int k = 0, ne;
+    double t0 = stats_start(tape);
+    int r;
+
+    lv[0] = flac_level(enc, 0);
+    lv[1] = flac_level(enc, 1);
+    for (s = 0; s < n; s += len) {
+	if (hbitsz >= FLAC_MIN_BLOCK) {  // one run, starts with edge k
+	    bx = tl->bx ^ !(k & 1);
+	    k++;
+	    len = ((k < tl->nedges) ? tl->edge[k]*hbitsz : n) - s;
+	    ne = 0;
+	}
+	else {
+	    len = n - s;
+	    if (len >= FLAC_BLOCK + FLAC_MIN_BLOCK)
+		len = FLAC_BLOCK;
+	    for (; (k < tl->nedges) && (tl->edge[k]*hbitsz <= s); k++)
+		bx = !bx;
+	    for (ne = 0; (k+ne < tl->nedges) &&
+		     (tl->edge[k+ne]*hbitsz < s+len); ne++)
+		edge[ne] = tl->edge[k+ne]*hbitsz - s;
+	}
+	ptr = flac_frame(enc, ptr, pos0 + s, len, bx, edge, ne, lv);
+	if ((ptr - out > (int) (sizeof(out) - FLAC_MAX_FRAME)) ||
+	    (s + len == n)) {
+	    stats_stop(tape, ABC_STAGE_RENDER, t0);
+	    t0 = stats_start(tape);
+	    r = tape_write(tape, out, ptr - out);
+	    stats_stop(tape, ABC_STAGE_WRITE, t0);
+	    if (r < 0)
+		return -1;
+	    ptr = out;
+	    t0 = stats_start(tape);
+	}
+    }
+    stats_stop(tape, ABC_STAGE_RENDER, t0);
+    return 0;
+}
+
+// render (or flac encode) the timeline of the next block and write it
+static int transmit_timeline(abc_tape_t* tape, abc_timeline_t* tl)
+{
+    abc_encoder_t* enc = tape->enc;
+    uint8_t chunk[RENDER_CHUNK_SIZE];
+    size_t chunk_samples = RENDER_CHUNK_SIZE/enc->frame_size;
+    size_t pos, n;
+    abc_timeline_t* prev;
+    double t0;
+    int r;
+
+    prev = tape->nblocks ? &tape->prev : NULL;
+    pos = 0;
+    if (enc->audio_format == AUDIO_FORMAT_FLAC) {
+	if (flac_block(tape, tl) < 0)
+	    return -1;
+	pos = abc_timeline_samples(enc, tl);
+    }
+    else {
+	for (;;) {
+	    t0 = stats_start(tape);
+	    n = abc_timeline_render(enc, prev, tl, pos, chunk_samples, chunk);
+	    stats_stop(tape, ABC_STAGE_RENDER, t0);
+	    if (n == 0)
+		break;
+	    t0 = stats_start(tape);
+	    r = tape_write(tape, chunk, n*enc->frame_size);
+	    stats_stop(tape, ABC_STAGE_WRITE, t0);
+	    if (r < 0)
+		return -1;
+	    if (tape->verify) {
+		t0 = stats_start(tape);
+		abc_verify_samples(tape->verify, chunk, n);
+		stats_stop(tape, ABC_STAGE_VERIFY, t0);
+	    }
+	    pos += n;
+	}
+    }
+    if (enc->exact)
+	tape->prev = *tl;
+    tape->nblocks++;
+    if (tape->stats) {
+	tape->stats->samples += pos;
+	tape->stats->blocks++;
+    }
+    return 0;
+}
+
+int abc_transmit_block(abc_tape_t* tape, uint8_t* buf)
+{
+    abc_encoder_t* enc = tape->enc;
+    uint8_t frame[MAX_FRAME_SIZE];
+    abc_timeline_t tl;
+    double t0 = stats_start(tape);
+    size_t n;
+
+    n = abc_frame_block(buf, tape->nblocks ? enc->gap : enc->leader, frame);
+    tape->bx = abc_timeline_build(&tl, frame, n, tape->bx,
+				  abc_block_time(enc, tape->nblocks));
+    stats_stop(tape, ABC_STAGE_FRAME, t0);
+    return transmit_timeline(tape, &tl);
+}
+
+// Frame a full data block where the data is, only the leader, sync,
+// STX and block header before it and ETX and checksum after it are
+// built. Same timeline as abc_make_data_block and abc_frame_block.
+static void frame_data_block(abc_tape_t* tape, abc_timeline_t* tl,
+			     int cnt, const uint8_t* data)
+{
+    abc_encoder_t* enc = tape->enc;
+    uint8_t head[MAX_LEADER+3+1+3];
+    uint8_t tail[3];
+    int leader = tape->nblocks ? enc->gap : enc->leader;
+    uint16_t csum;
+
+    memset(head, 0, leader);
+    memset(head+leader, SYNC, 3);
+    head[leader+3] = STX;
+    head[leader+4] = 0;           // pad
+    head[leader+5] = cnt;         // blcnt, little endian
+    head[leader+6] = cnt >> 8;
+    csum = abc_checksum16(head+leader+4, 3) +
+	abc_checksum16((uint8_t*) data, BLOCK_DATA_SIZE) + ETX;
+    tail[0] = ETX;
+    tail[1] = csum;
+    tail[2] = csum >> 8;
+    timeline_start(tl, tape->bx, abc_block_time(enc, tape->nblocks));
+    timeline_bytes(tl, head, leader+3+1+3);
+    timeline_bytes(tl, data, BLOCK_DATA_SIZE);
+    timeline_bytes(tl, tail, sizeof(tail));
+    tape->bx = timeline_end(tl);
+}
+
+// 3 + 8 + 3
+// <<0xff,0xff,0xff,F,I,L,E,N,A,M,E,'B','A','C', 0:
+
+void abc_make_name_block(abc_tape_t* tape, name_block_t* block)
+{
+    memset(block->header, 0xff, sizeof(block->header));
+    memcpy(block->name,   tape->name, sizeof(tape->name));
+    memcpy(block->ext,    tape->ext,  sizeof(tape->ext));
+    memset(block->pad,    0,    sizeof(block->pad));
+}
+
+void abc_make_data_block(int cnt, const char* buf, size_t len,
+			 data_block_t* block)
+{
+    block->pad = 0;
+    block->blcnt = cnt;
+    if (len >= sizeof(block->data)) {
+	memcpy(&block->data, buf, sizeof(block->data));
+    }
+    else {
+	memcpy(&block->data, buf, len);
+	memset(block->data+len, 0, sizeof(block->data)-len);
+    }
+    little16(&block->blcnt);
+}
+
+int abc_transmit_name_block(abc_tape_t* tape)
+{
+    name_block_t block;
+
+    abc_make_name_block(tape, &block);
+    return abc_transmit_block(tape, (uint8_t*) &block);
+}
+
+// transmit up to 253 bytes as the next data block, a full block is
+// framed from buf without copying it
+int abc_transmit_data_block(abc_tape_t* tape, const char* buf, size_t len)
+{
+    data_block_t block;
+    abc_timeline_t tl;
+    double t0;
+
+    if (len < BLOCK_DATA_SIZE) {  // zero padded
+	abc_make_data_block(tape->blcnt++, buf, len, &block);
+	return abc_transmit_block(tape, (uint8_t*) &block);
+    }
+    t0 = stats_start(tape);
+    frame_data_block(tape, &tl, tape->blcnt++, (const uint8_t*) buf);
+    stats_stop(tape, ABC_STAGE_FRAME, t0);
+    return transmit_timeline(tape, &tl);
+}
+
+int abc_transmit_data_blocks(abc_tape_t* tape, const char* buf, size_t len)
+{
+    while (len > 0) {
+	if (abc_transmit_data_block(tape, buf, len) < 0)
+	    return -1;
+	buf += BLOCK_DATA_SIZE;
+	len = (len >= BLOCK_DATA_SIZE) ? len-BLOCK_DATA_SIZE : 0;
+    }
+    return 0;
+}
+
+// number of samples in the timeline
+size_t abc_timeline_samples(abc_encoder_t* enc, abc_timeline_t* tl)
+{
+    return half_bit_sample(enc, tl->t0 + tl->nhalf) -
+	half_bit_sample(enc, tl->t0);
+}
+
+// half bit time of edge k of prev and tl together
+static inline int64_t edge_time(abc_timeline_t* prev, abc_timeline_t* tl,
+				int k)
+{
+    if (prev != NULL) {
+	if (k < prev->nedges)
+	    return prev->t0 + prev->edge[k];
+	k -= prev->nedges;
+    }
+    return tl->t0 + tl->edge[k];
+}
+
+// Edge positions in samples, t*rate/(2*baud) is kept as a whole
+// sample s and a remainder so stepping to the next edge needs no
+// division.
+typedef struct {
+    int64_t t;
+    int64_t s;
+    int64_t rem;
+    int64_t den;
+    int64_t q;     // rate / den
+    int64_t r;     // rate % den
+    uint64_t phmul;  // remainder to phase, (rem*phmul) >> 32
+} edge_cursor_t;
+
+static void cursor_init(abc_encoder_t* enc, edge_cursor_t* c, int64_t t)
+{
+    c->den = 2*enc->baud;
+    c->q = enc->sample_rate / c->den;
+    c->r = enc->sample_rate % c->den;
+    c->phmul = (((uint64_t) BLEP_PHASES << 32) / c->den) + 1;
+    c->t = t;
+    c->s = (t*enc->sample_rate) / c->den;
+    c->rem = (t*enc->sample_rate) - c->s*c->den;
+}
+
+// move to half bit t (t >= c->t), return the sample before it
+static inline int64_t cursor_step(edge_cursor_t* c, int64_t t, int* ph)
+{
+    int64_t dt = t - c->t;
+
+    c->t = t;
+    c->s += dt*c->q;
+    c->rem += dt*c->r;
+    while(c->rem >= c->den) {
+	c->rem -= c->den;
+	c->s++;
+    }
+    *ph = (c->rem*c->phmul) >> 32;
+    return c->s;
+}
+
+#define EXACT_CHUNK 1024
+#define EXACT_EDGES (EXACT_CHUNK+2*BLEP_WIDTH+2)
+
+// Exact rate, samples [a, a+count) on the tape. A sample is the settled
+// level plus the band limited steps of the edges still in progress,
+// the edges of prev reach BLEP_WIDTH*2 samples into this block.
+static void render_exact(abc_encoder_t* enc, abc_timeline_t* prev,
+			 abc_timeline_t* tl, int64_t a, size_t count,
+			 uint8_t* out)
+{
+    float v[EXACT_CHUNK];
+    int64_t es[EXACT_EDGES];   // first sample after edge kr+i
+    uint8_t eph[EXACT_EDGES];
+    int nedges = (prev ? prev->nedges : 0) + tl->nedges;
+    int bx0 = prev ? prev->bx : tl->bx;
+    int lo, hi, kr, k0, ne, bx, ph;
+    edge_cursor_t cur;
+
+    // first edge still in progress at a
+    lo = 0;
+    hi = nedges;
+    cursor_init(enc, &cur, 0);
+    while(lo < hi) {
+	int mid = (lo + hi) / 2;
+	cursor_init(enc, &cur, edge_time(prev, tl, mid));
+	if (cur.s + 1 + 2*BLEP_WIDTH <= a)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+    kr = lo;
+    k0 = kr;
+    bx = bx0 ^ (k0 & 1);   // level before edge k0
+    if (kr < nedges)
+	cursor_init(enc, &cur, edge_time(prev, tl, kr));
+    ne = 0;
+
+    while(count > 0) {
+	size_t n = (count < EXACT_CHUNK) ? count : EXACT_CHUNK;
+	int64_t end = a + n;
+	int64_t pos;
+	int k;
+
+	// edges in progress and the first one after the chunk, there
+	// is at most one edge per sample
+	while((kr+ne < nedges) && ((ne == 0) || (es[ne-1] < end))) {
+	    es[ne] = cursor_step(&cur, edge_time(prev, tl, kr+ne), &ph) + 1;
+	    eph[ne++] = ph;
+	}
+	// settled level, an edge counts from the first sample after it
+	pos = a;
+	while(pos < end) {
+	    int64_t next = (k0 - kr < ne) ? es[k0 - kr] : end;
+	    float lev = enc->level[bx];
+	    if (next > end)
+		next = end;
+	    while(pos < next)
+		v[pos++ - a] = lev;
+	    if (next < end) {
+		bx = !bx;
+		k0++;
+	    }
+	}
+	// steps in progress, relative to the level after the edge
+	for (k = 0; (k < ne) && (es[k] < end); k++) {
+	    int lev = bx0 ^ ((kr+k+1) & 1);  // level after the edge
+	    float d = enc->level[lev] - enc->level[!lev];
+	    float* step = enc->blep[eph[k]];
+	    int64_t m = es[k] - a;
+	    int j;
+
+	    for (j = 0; j < 2*BLEP_WIDTH; j++, m++) {
+		if ((m >= 0) && (m < (int64_t) n))
+		    v[m] += d*(step[j] - 1.0f);
+	    }
+	}
+	// drop the edges done before the next chunk
+	for (k = 0; (kr+k < k0) && (es[k] + 2*BLEP_WIDTH <= end); k++)
+	    ;
+	if (k > 0) {
+	    kr += k;
+	    ne -= k;
+	    memmove(es, es+k, ne*sizeof(int64_t));
+	    memmove(eph, eph+k, ne);
+	}
+	enc->kernel->put(v, n, out);
+	out += n*enc->frame_size;
+	a = end;
+	count -= n;
+    }
+}
+
+// expand samples [start, start+count) of the timeline into out,
+// return the number of samples rendered. prev is the block before
+// (or NULL), its last edges are still settling in exact mode.
+size_t abc_timeline_render(abc_encoder_t* enc, abc_timeline_t* prev,
+			   abc_timeline_t* tl, size_t start, size_t count,
+			   uint8_t* out)
+{
+    size_t hbitsz = enc->hbitsz;
+    size_t end = abc_timeline_samples(enc, tl);
+    int lo, hi, bx;
+
+    if (start >= end)
+	return 0;
+    if (count < end - start)
+	end = start + count;
+    if (enc->exact) {
+	render_exact(enc, prev, tl, half_bit_sample(enc, tl->t0) + start,
+		     end - start, out);
+	return end - start;
+    }
+    // find the first edge after start
+    lo = 0;
+    hi = tl->nedges;
+    while(lo < hi) {
+	int mid = (lo + hi) / 2;
+	if (tl->edge[mid]*hbitsz <= start)
+	    lo = mid+1;
+	else
+	    hi = mid;
+    }
+    bx = tl->bx ^ (lo & 1);
+    enc->kernel->runs(enc, tl, lo, bx, start, end, out);
+    return end - start;
+}
+
+// expand samples [start, start+count) of a tape of nblk block
+// timelines, return the number of samples rendered
+int64_t abc_render_samples(abc_encoder_t* enc, abc_timeline_t* tl, int nblk,
+			   int64_t start, int64_t count, uint8_t* out)
+{
+    int64_t done = 0;
+    int i = 0;
+
+    while((i < nblk) && (start >= abc_timeline_samples(enc, &tl[i])))
+	start -= abc_timeline_samples(enc, &tl[i++]);
+    while((i < nblk) && (done < count)) {
+	size_t n = abc_timeline_render(enc, i ? &tl[i-1] : NULL, &tl[i],
+				       start, count-done, out);
+	out += n*enc->frame_size;
+	done += n;
+	start = 0;
+	i++;
+    }
+    return done;
+}
+
+// render len framed bytes starting in phase bx, return the end phase
+int abc_render_frame(abc_encoder_t* enc, uint8_t* frame, size_t len,
+		     int bx, uint8_t* out)
+{
+    abc_timeline_t tl;
+
+    bx = abc_timeline_build(&tl, frame, len, bx, 0);
+    abc_timeline_render(enc, NULL, &tl, 0, abc_timeline_samples(enc, &tl),
+			out);
+    return bx;
+}
+
+typedef struct {
+    abc_encoder_t* enc;
+    uint8_t* frames;   // nblk framed blocks, MAX_FRAME_SIZE apart
+    uint8_t* phase;    // start phase of each block
+    uint8_t* out;      // nblk rendered blocks
+    abc_timeline_t* prev;  // block before the first (or NULL)
+    int base;          // blocks on the tape before the first
+    int nblk;
+    int next;          // next block to render
+} render_job_t;
+
+static void* render_worker(void* arg)
+{
+    render_job_t* job = (render_job_t*) arg;
+    abc_encoder_t* enc = job->enc;
+    int64_t s0 = abc_num_samples(enc, job->base);
+    abc_timeline_t tl, ptl;
+    int i;
+
+    while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+	  job->nblk) {
+	int64_t blk = job->base + i;
+	abc_timeline_t* prev = job->prev;
+	uint8_t* out = job->out +
+	    (abc_num_samples(enc, blk) - s0)*enc->frame_size;
+
+	abc_timeline_build(&tl, job->frames + (size_t) i*MAX_FRAME_SIZE,
+			   abc_frame_len(enc, blk), job->phase[i],
+			   abc_block_time(enc, blk));
+	if (enc->exact && (i > 0)) {
+	    abc_timeline_build(&ptl,
+			       job->frames + (size_t) (i-1)*MAX_FRAME_SIZE,
+			       abc_frame_len(enc, blk-1), job->phase[i-1],
+			       abc_block_time(enc, blk-1));
+	    prev = &ptl;
+	}
+	abc_timeline_render(enc, prev, &tl, 0, abc_timeline_samples(enc, &tl),
+			    out);
+    }
+    return NULL;
+}
+
+// Frame name block and all data blocks, compute the start phase of
+// every block from the parity of the bytes before it, then render the
+// blocks on a pool of threads directly into their offsets in out.
+int abc_transmit_blocks_parallel(abc_tape_t* tape, const char* buf,
+				 size_t len, int jobs, uint8_t* out)
+{
+    abc_encoder_t* enc = tape->enc;
+    name_block_t name_block;
+    render_job_t job;
+    pthread_t* tid;
+    double t0 = stats_start(tape);
+    int i, j, bx, nblk;
+
+    nblk = abc_num_blocks(len);
+    job.frames = malloc((size_t) nblk*MAX_FRAME_SIZE);
+    job.phase  = malloc(nblk);
+    tid = malloc(jobs*sizeof(pthread_t));
+    if ((job.frames == NULL) || (job.phase == NULL) || (tid == NULL)) {
+	free(job.frames);
+	free(job.phase);
+	free(tid);
+	return -1;
+    }
+    abc_make_name_block(tape, &name_block);
+    abc_frame_block((uint8_t*) &name_block,
+		    tape->nblocks ? enc->gap : enc->leader, job.frames);
+    for (i = 1; i < nblk; i++) {
+	data_block_t block;
+	abc_make_data_block(tape->blcnt++, buf, len, &block);
+	abc_frame_block((uint8_t*) &block, enc->gap,
+			job.frames + (size_t) i*MAX_FRAME_SIZE);
+	buf += BLOCK_DATA_SIZE;
+	len = (len >= BLOCK_DATA_SIZE) ? len-BLOCK_DATA_SIZE : 0;
+    }
+    // phase prefix, a byte flips the phase when it has odd parity
+    bx = tape->bx;
+    for (i = 0; i < nblk; i++) {
+	uint8_t* frame = job.frames + (size_t) i*MAX_FRAME_SIZE;
+	int flen = abc_frame_len(enc, tape->nblocks + i);
+	job.phase[i] = bx;
+	for (j = 0; j < flen; j++)
+	    bx ^= enc->byte_phase[frame[j]];
+    }
+    tape->bx = bx;
+    stats_stop(tape, ABC_STAGE_FRAME, t0);
+
+    t0 = stats_start(tape);
+    job.enc  = enc;
+    job.prev = tape->nblocks ? &tape->prev : NULL;
+    job.base = tape->nblocks;
+    job.out  = out;
+    job.nblk = nblk;
+    job.next = 0;
+    for (i = 0; i < jobs; i++) {
+	if (pthread_create(&tid[i], NULL, render_worker, &job) != 0)
+	    break;
+    }
+    if (i == 0)       // no threads, render here
+	render_worker(&job);
+    while(i--)
+	pthread_join(tid[i], NULL);
+    stats_stop(tape, ABC_STAGE_RENDER, t0);
+    if (tape->verify) {
+	t0 = stats_start(tape);
+	abc_verify_samples(tape->verify, out,
+			   abc_num_samples(enc, tape->nblocks+nblk) -
+			   abc_num_samples(enc, tape->nblocks));
+	stats_stop(tape, ABC_STAGE_VERIFY, t0);
+    }
+    if (tape->stats) {  // rendered in place, no sink writes
+	int64_t n = abc_num_samples(enc, tape->nblocks+nblk) -
+	    abc_num_samples(enc, tape->nblocks);
+	tape->stats->samples += n;
+	tape->stats->output_bytes += n*enc->frame_size;
+	tape->stats->blocks += nblk;
+    }
+    if (enc->exact)
+	abc_timeline_build(&tape->prev,
+			   job.frames + (size_t) (nblk-1)*MAX_FRAME_SIZE,
+			   abc_frame_len(enc, tape->nblocks+nblk-1),
+			   job.phase[nblk-1],
+			   abc_block_time(enc, tape->nblocks+nblk-1));
+    tape->nblocks += nblk;
+    free(tid);
+    free(job.phase);
+    free(job.frames);
+    return 0;
+}
+
+// Loopback check, see abc_verify_t. The middle of half bit t is
+// (2t+1)*rate/(4*baud) samples in, later in exact mode where the
+// signal is delayed. Only one sample per half bit is read and only
+// the top bit of it, the low level is below zero and the high above.
+static void verify_error(abc_verify_t* v, const char* what)
+{
+    abc_encoder_t* enc = v->enc;
+
+    if (v->error[0] == '\0')
+	snprintf(v->error, sizeof(v->error),
+		 "block %ld at sample %ld: %s", (long) v->blk,
+		 (long) half_bit_sample(enc, abc_block_time(enc, v->blk)),
+		 what);
+    v->bad = 1;
+}
+
+// top bit of byte b moved to bit i, the sign of the sample
+#define VERIFY_SIGN(b, i) ((((uint32_t) (b) & 0x80) << (i)) >> 7)
+
+// the bytes of block v->blk are in v->frame
+static void verify_block(abc_verify_t* v)
+{
+    abc_encoder_t* enc = v->enc;
+    size_t lead = v->flen - FRAME_BLOCK_SIZE;
+    uint8_t* p = v->frame + lead;
+    uint16_t sum;
+    size_t i;
+
+    for (i = 0; (i < lead) && (v->frame[i] == 0); i++)
+	;
+    if (i < lead)
+	verify_error(v, "leader not zero");
+    else if ((p[0] != SYNC) || (p[1] != SYNC) || (p[2] != SYNC))
+	verify_error(v, "no SYNC");
+    else if (p[3] != STX)
+	verify_error(v, "no STX");
+    else if (p[4+256] != ETX)
+	verify_error(v, "no ETX");
+    else {
+	sum = abc_checksum16(p+4, 256) + ETX;
+	if ((p[4+257] | (p[4+258] << 8)) != sum)
+	    verify_error(v, "checksum mismatch");
+	else if ((v->blk == 0) &&
+		 ((p[4] != 0xff) || (p[5] != 0xff) || (p[6] != 0xff)))
+	    verify_error(v, "not a name block");
+	else if ((v->blk > 0) && ((p[5] | (p[6] << 8)) !=
+				  ((v->blk-1) & 0xffff)))
+	    verify_error(v, "block counter mismatch");
+    }
+    v->nblocks++;
+    if (v->bad)
+	v->nbad++;
+    v->bad = 0;
+    v->blk++;
+    v->len = 0;
+    v->flen = abc_frame_len(enc, v->blk);
+}
+
+// levels of the 16 half bits of a byte, every bit starts with an
+// edge and a "1" has one in the middle
+static inline void verify_byte(abc_verify_t* v, uint32_t p)
+{
+    int bx = (v->level < 0) ? !(p & 1) : v->level;  // tape start
+    uint32_t d = p ^ ((p << 1) | bx);  // level changes
+    uint32_t x = (d >> 1) & 0x5555;
+
+    if ((d & 0x5555) != 0x5555) {
+	char what[32];
+	snprintf(what, sizeof(what), "no edge in byte %ld", (long) v->len);
+	verify_error(v, what);
+    }
+    x = (x | (x >> 1)) & 0x3333;
+    x = (x | (x >> 2)) & 0x0f0f;
+    x = (x | (x >> 4)) & 0x00ff;
+    v->frame[v->len++] = x;
+    v->level = (p >> 15) & 1;
+    if (v->len == v->flen)
+	verify_block(v);
+}
+
+int abc_verify_init(abc_verify_t* v, abc_encoder_t* enc)
+{
+    int wav = (enc->audio_format == AUDIO_FORMAT_WAV);
+    uint32_t n;
+    sample_t s;
+
+    memset(v, 0, sizeof(abc_verify_t));
+    if ((enc->audio_format == AUDIO_FORMAT_FLAC) ||
+	(enc->num_channels != 1)) {
+	errno = EINVAL;
+	return -1;
+    }
+    v->enc = enc;
+    v->den = 4*enc->baud;
+    // an exact step is halfway BLEP_WIDTH+1/2 samples after the edge
+    n = enc->sample_rate + (enc->exact ? 2*enc->baud : 0);
+    v->at = n / v->den + (enc->exact ? BLEP_WIDTH : 0);
+    v->rem = n % v->den;
+    v->step = (2*enc->sample_rate) / v->den;
+    v->frac = (2*enc->sample_rate) % v->den;
+    v->msb = wav ? enc->kernel->sample_size-1 : 0;
+    // the top bit is set for the low level, but not in unsigned u8
+    enc->kernel->level(LOW_LEVEL, &s);
+    v->flip = (s.data[v->msb] & 0x80) ? 0xffff : 0;
+    v->level = -1;
+    v->flen = abc_frame_len(enc, 0);
+    return 0;
+}
+
+// count samples that follow the ones seen so far
+void abc_verify_samples(abc_verify_t* v, const uint8_t* ptr, size_t count)
+{
+    const uint8_t* top = ptr + v->msb;
+    size_t fs = v->enc->frame_size;
+    int64_t pos = v->pos;
+    int64_t end = pos + count;
+    int64_t at = v->at;
+    uint32_t rem = v->rem;
+    uint32_t bits = v->bits;
+    int n = v->nhalf;
+
+    // a whole byte at a time when the half bits are a fixed number
+    // of samples apart
+    while((n == 0) && (v->frac == 0) && (at + 15*v->step < end)) {
+	const uint8_t* q = top + (at - pos)*fs;
+	size_t stride = v->step*fs;
+	int i;
+
+	for (i = 0; i < 4; i++, q += 4*stride)
+	    bits = (bits >> 4) | VERIFY_SIGN(q[0], 12) |
+		VERIFY_SIGN(q[stride], 13) | VERIFY_SIGN(q[2*stride], 14) |
+		VERIFY_SIGN(q[3*stride], 15);
+	at += 16*v->step;
+	verify_byte(v, bits ^ v->flip);
+	bits = 0;
+    }
+    while(at < end) {
+	bits |= VERIFY_SIGN(top[(at - pos)*fs], n);
+	at += v->step;
+	if ((rem += v->frac) >= v->den) {
+	    rem -= v->den;
+	    at++;
+	}
+	if (++n == 16) {
+	    verify_byte(v, bits ^ v->flip);
+	    bits = 0;
+	    n = 0;
+	}
+    }
+    v->pos = end;
+    v->at = at;
+    v->rem = rem;
+    v->bits = bits;
+    v->nhalf = n;
+}
+
+// all nblocks must have been read without a mismatch, the first
+// mismatch is in v->error
+int abc_verify_end(abc_verify_t* v, int64_t nblocks)
+{
+    if (v->nblocks < nblocks)
+	verify_error(v, "samples missing");
+    if (v->error[0] != '\0') {
+	errno = EIO;
+	return -1;
+    }
+    return 0;
+}
+
+// encode buf as one tape with header, filename gives the tape name
+int abc_encode(abc_encoder_t* enc, abc_sink_t* sink,
+	       const char* filename, const char* buf, size_t len)
+{
+    abc_tape_t tape;
+
+    abc_tape_init(&tape, enc, sink);
+    if (filename != NULL)
+	abc_tape_set_name(&tape, filename, NULL);
+    if (abc_write_header(&tape, abc_num_samples(enc, abc_num_blocks(len))) < 0)
+	return -1;
+    if (abc_transmit_name_block(&tape) < 0)
+	return -1;
+    return abc_transmit_data_blocks(&tape, buf, len);
+}
+
+// label of block b of a program, "NAME.EXT" for the name block and
+// "NAME.EXT #n" for data block n
+static int block_label(abc_program_t* p, int b, char* buf)
+{
+    int i, n = 0;
+
+    for (i = 0; (i < 8) && (p->name[i] != ' '); i++)
+	buf[n++] = p->name[i];
+    buf[n++] = '.';
+    for (i = 0; (i < 3) && (p->ext[i] != ' '); i++)
+	buf[n++] = p->ext[i];
+    if (b > 0)
+	n += sprintf(buf+n, " #%d", b-1);
+    buf[n] = '\0';
+    return n;
+}
+
+// "cue " and "LIST" "adtl" chunks with a cue point and a label at
+// every block, after the data chunk (and its pad byte)
+static uint8_t* wav_cues(abc_encoder_t* enc, abc_program_t* prog, int nprog,
+			 int64_t numsamp, size_t* lenp)
+{
+    size_t ncue = 0, size, labl = 0;
+    uint8_t* buf;
+    uint8_t* ptr;
+    uint8_t* cue;
+    char label[32];
+    int i, b, id;
+
+    for (i = 0; i < nprog; i++) {
+	for (b = 0; b < prog[i].nblocks; b++)
+	    labl += 12 + ((block_label(&prog[i], b, label) + 2) & ~1);
+	ncue += prog[i].nblocks;
+    }
+    size = 1 + (8 + 4 + 24*ncue) + (8 + 4 + labl);
+    if ((buf = malloc(size)) == NULL)
+	return NULL;
+    ptr = buf;
+    if ((numsamp*enc->frame_size) & 1)
+	*ptr++ = 0;
+    ptr = put_tag(ptr, WAV_ID_CUE);
+    ptr = put_u32le(ptr, 4 + 24*ncue);
+    ptr = put_u32le(ptr, ncue);
+    cue = ptr;
+    ptr += 24*ncue;
+    ptr = put_tag(ptr, WAV_ID_LIST);
+    ptr = put_u32le(ptr, 4 + labl);
+    ptr = put_tag(ptr, WAV_ID_ADTL);
+    id = 1;
+    for (i = 0; i < nprog; i++) {
+	for (b = 0; b < prog[i].nblocks; b++, id++) {
+	    uint32_t pos = prog[i].start + abc_num_samples(enc, b);
+	    int n = block_label(&prog[i], b, label) + 1;
+
+	    cue = put_u32le(cue, id);
+	    cue = put_u32le(cue, pos);
+	    cue = put_tag(cue, WAV_ID_DATA);
+	    cue = put_u32le(cue, 0);
+	    cue = put_u32le(cue, 0);
+	    cue = put_u32le(cue, pos);
+	    ptr = put_tag(ptr, WAV_ID_LABL);
+	    ptr = put_u32le(ptr, 4 + n);
+	    ptr = put_u32le(ptr, id);
+	    memcpy(ptr, label, n);
+	    ptr += n;
+	    if (n & 1)
+		*ptr++ = 0;
+	}
+    }
+    *lenp = ptr - buf;
+    return buf;
+}
+
+// n samples of silence
+static int write_silence(abc_tape_t* tape, int64_t n)
+{
+    abc_encoder_t* enc = tape->enc;
+    uint8_t chunk[RENDER_CHUNK_SIZE];
+    size_t chunk_samples = RENDER_CHUNK_SIZE/enc->frame_size;
+    sample_t silence;
+    size_t k;
+
+    enc->kernel->level(0.0, &silence);
+    for (k = 0; k < chunk_samples; k++)
+	memcpy(chunk + k*enc->frame_size, silence.data, enc->frame_size);
+    while(n > 0) {
+	size_t m = (n < (int64_t) chunk_samples) ? n : chunk_samples;
+	if (tape_write(tape, chunk, m*enc->frame_size) < 0)
+	    return -1;
+	n -= m;
+    }
+    return 0;
+}
+
+// Encode nprog programs one after the other into one stream with gap
+// samples of silence between them. Each program is a tape of its own
+// (name block and data blocks), wav output gets a cue point at the
+// start of every block.
+int abc_encode_image(abc_encoder_t* enc, abc_sink_t* sink, int nprog,
+		     abc_program_t* prog, int64_t gap, abc_stats_t* stats)
+{
+    abc_tape_t tape;
+    uint8_t* cues = NULL;
+    size_t ncue = 0;
+    int64_t numsamp = 0;
+    int i, err = 0;
+
+    if (enc->audio_format == AUDIO_FORMAT_FLAC) {  // silence is pcm
+	errno = EINVAL;
+	return -1;
+    }
+    for (i = 0; i < nprog; i++) {
+	abc_tape_init(&tape, enc, NULL);
+	if (prog[i].filename != NULL)
+	    abc_tape_set_name(&tape, prog[i].filename, NULL);
+	memcpy(prog[i].name, tape.name, sizeof(prog[i].name));
+	memcpy(prog[i].ext, tape.ext, sizeof(prog[i].ext));
+	if (i > 0)
+	    numsamp += gap;
+	prog[i].start = numsamp;
+	prog[i].nblocks = abc_num_blocks(prog[i].len);
+	numsamp += abc_num_samples(enc, prog[i].nblocks);
+    }
+    abc_tape_init(&tape, enc, sink);
+    tape.stats = stats;
+    if (enc->audio_format == AUDIO_FORMAT_WAV) {
+	if ((cues = wav_cues(enc, prog, nprog, numsamp, &ncue)) == NULL)
+	    return -1;
+	tape.trailer = ncue;
+    }
+    err = abc_write_header(&tape, numsamp);
+    for (i = 0; (err == 0) && (i < nprog); i++) {
+	abc_tape_t ptape;
+
+	if ((i > 0) && ((err = write_silence(&tape, gap)) < 0))
+	    break;
+	abc_tape_init(&ptape, enc, sink);
+	ptape.stats = stats;
+	memcpy(ptape.name, prog[i].name, sizeof(ptape.name));
+	memcpy(ptape.ext, prog[i].ext, sizeof(ptape.ext));
+	if ((err = abc_transmit_name_block(&ptape)) == 0)
+	    err = abc_transmit_data_blocks(&ptape, prog[i].buf, prog[i].len);
+    }
+    if ((err == 0) && (cues != NULL))
+	err = tape_write(&tape, cues, ncue);
+    free(cues);
+    return err;
+}
+
+// text index of a tape image, "<sample> <label>" for every block
+void abc_image_index(abc_encoder_t* enc, abc_program_t* prog, int nprog,
+		     FILE* f)
+{
+    char label[32];
+    int i, b;
+
+    for (i = 0; i < nprog; i++) {
+	for (b = 0; b < prog[i].nblocks; b++) {
+	    block_label(&prog[i], b, label);
+	    fprintf(f, "%ld %s\n", prog[i].start + abc_num_samples(enc, b),
+		    label);
+	}
+    }
+}
+
+// one tape of abc_encode_channels, blocks are framed when needed
+typedef struct {
+    abc_tape_t tape;      // name, phase and block count
+    const char* buf;      // data not yet framed
+    size_t len;
+    abc_timeline_t tl[2]; // current block and the one before
+    int cur;
+    size_t pos;           // samples rendered of the current block
+    int done;
+} channel_t;
+
+// frame the next block of the channel, 0 when there are no more
+static int channel_next(channel_t* ch)
+{
+    abc_tape_t* tape = &ch->tape;
+    abc_encoder_t* enc = tape->enc;
+    uint8_t frame[MAX_FRAME_SIZE];
+    union {
+	name_block_t name;
+	data_block_t data;
+    } block;
+    size_t n;
+
+    if (tape->nblocks == 0)
+	abc_make_name_block(tape, &block.name);
+    else if (ch->len > 0) {
+	abc_make_data_block(tape->blcnt++, ch->buf, ch->len, &block.data);
+	n = (ch->len >= BLOCK_DATA_SIZE) ? BLOCK_DATA_SIZE : ch->len;
+	ch->buf += n;
+	ch->len -= n;
+    }
+    else
+	return 0;
+    n = abc_frame_block((uint8_t*) &block,
+			tape->nblocks ? enc->gap : enc->leader, frame);
+    ch->cur ^= 1;
+    tape->bx = abc_timeline_build(&ch->tl[ch->cur], frame, n, tape->bx,
+				  abc_block_time(enc, tape->nblocks));
+    tape->nblocks++;
+    ch->pos = 0;
+    return 1;
+}
+
+// render up to count mono samples of the channel, return how many
+static size_t channel_render(channel_t* ch, size_t count, uint8_t* out)
+{
+    abc_encoder_t* enc = ch->tape.enc;
+    size_t done = 0;
+
+    while(!ch->done && (done < count)) {
+	abc_timeline_t* tl = &ch->tl[ch->cur];
+	abc_timeline_t* prev = (ch->tape.nblocks > 1) ? &ch->tl[!ch->cur] : NULL;
+	size_t n;
+
+	if ((ch->tape.nblocks == 0) ||
+	    (ch->pos >= abc_timeline_samples(enc, tl))) {
+	    ch->done = !channel_next(ch);
+	    continue;
+	}
+	n = abc_timeline_render(enc, prev, tl, ch->pos, count - done,
+				out + done*enc->frame_size);
+	ch->pos += n;
+	done += n;
+    }
+    return done;
+}
+
+// Encode nch files as one stream, file i in channel i. Each channel
+// is rendered a chunk at a time as a mono tape and woven into the
+// frames, channels that end early are padded with silence.
+int abc_encode_channels(abc_encoder_t* enc, abc_sink_t* sink, int nch,
+			char** filenames, char** bufs, size_t* lens,
+			abc_stats_t* stats)
+{
+    size_t size = enc->frame_size;   // one mono sample
+    size_t chunk_samples = RENDER_CHUNK_SIZE/size;
+    abc_encoder_t* henc;
+    channel_t* ch;
+    uint8_t* mono;
+    uint8_t* out;
+    abc_tape_t tape;
+    sample_t silence;
+    int64_t numsamp = 0, left;
+    double t0;
+    int i, err = 0;
+
+    if ((nch < 1) || (nch > MAX_CHANNELS) ||
+	(enc->audio_format == AUDIO_FORMAT_FLAC)) {  // pcm frames only
+	errno = EINVAL;
+	return -1;
+    }
+    henc = malloc(sizeof(abc_encoder_t));
+    ch = calloc(nch, sizeof(channel_t));
+    mono = malloc(RENDER_CHUNK_SIZE);
+    out = malloc(RENDER_CHUNK_SIZE*nch);
+    if ((henc == NULL) || (ch == NULL) || (mono == NULL) || (out == NULL)) {
+	free(henc);
+	free(ch);
+	free(mono);
+	free(out);
+	return -1;
+    }
+    // the header and the writes are for nch channel frames
+    *henc = *enc;
+    henc->num_channels = nch;
+    henc->frame_size = size*nch;
+    abc_tape_init(&tape, henc, sink);
+    tape.stats = stats;
+    enc->kernel->level(0.0, &silence);
+
+    for (i = 0; i < nch; i++) {
+	int64_t n = abc_num_samples(enc, abc_num_blocks(lens[i]));
+	abc_tape_init(&ch[i].tape, enc, NULL);
+	if (filenames[i] != NULL)
+	    abc_tape_set_name(&ch[i].tape, filenames[i], NULL);
+	ch[i].buf = bufs[i];
+	ch[i].len = lens[i];
+	numsamp = (n > numsamp) ? n : numsamp;
+    }
+    if (abc_write_header(&tape, numsamp) < 0)
+	err = -1;
+    for (left = numsamp; (err == 0) && (left > 0); left -= chunk_samples) {
+	size_t count = (left < (int64_t) chunk_samples) ? left : chunk_samples;
+	size_t n, k;
+
+	for (i = 0; i < nch; i++) {
+	    t0 = stats_start(&tape);
+	    n = channel_render(&ch[i], count, mono);
+	    for (k = n; k < count; k++)
+		memcpy(mono + k*size, silence.data, size);
+	    enc->kernel->weave(mono, count, size*nch, out + i*size);
+	    stats_stop(&tape, ABC_STAGE_RENDER, t0);
+	}
+	t0 = stats_start(&tape);
+	err = tape_write(&tape, out, count*size*nch);
+	stats_stop(&tape, ABC_STAGE_WRITE, t0);
+    }
+    if (stats) {
+	stats->samples += numsamp;
+	for (i = 0; i < nch; i++)
+	    stats->blocks += ch[i].tape.nblocks;
+    }
+    free(out);
+    free(mono);
+    free(ch);
+    free(henc);
+    return err;
+}
+
+// replace \n with \r and remove multiple \r\r.. with one \r, in place.
+// *cr is set when the last byte out was \r so a run that continues in
+// the next chunk is collapsed too, start with *cr = 0.
+size_t abc_konvert_chunk(char* ptr, size_t len, int* cr)
+{
+    char* ptr0 = ptr;
+    char* end = ptr + len;
+    char* fptr = ptr;
+    int oldc = *cr ? '\r' : 0;
+    int c, i;
+
+#ifdef __SSE2__
+    {
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i ret = _mm_set1_epi8('\r');
+	const __m128i flip = _mm_set1_epi8('\n' ^ '\r');
+
+	// 16 bytes at a time, \n is flipped to \r and the vector is
+	// stored whole unless a \r follows a \r
+	while(end - ptr >= 16) {
+	    __m128i v = _mm_loadu_si128((const __m128i*) ptr);
+	    __m128i n = _mm_cmpeq_epi8(v, nl);
+	    unsigned m;
+
+	    v = _mm_xor_si128(v, _mm_and_si128(n, flip));
+	    m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, ret));
+	    if ((m & ((m << 1) | (oldc == '\r'))) == 0) {
+		_mm_storeu_si128((__m128i*) fptr, v);
+		fptr += 16;
+		ptr += 16;
+		oldc = (m & 0x8000) ? '\r' : 0;
+		continue;
+	    }
+	    for (i = 0; i < 16; i++) {
+		c = *ptr++;
+		if (c == '\n')
+		    c = '\r';
+		if ((c != '\r') || (oldc != '\r'))
+		    *fptr++ = c;
+		oldc = c;
+	    }
+	}
+    }
+#endif
+    while(ptr < end) {
+	c = *ptr++;
+	if (c == '\n')
+	    c = '\r';
+	if (c == '\r') {
+	    if (oldc != '\r')
+		*fptr++ = c;
+	}
+	else { // c != '\r'
+	    *fptr++ = c;
+	}
+	oldc = c;
+    }
+    *cr = (oldc == '\r');
+    return fptr - ptr0;
+}
+
+// replace \n with \r and remove multiple \r\r.. with one \r
+size_t abc_konvert_line(char* ptr, size_t len)
+{
+    int cr = 0;
+
+    return abc_konvert_chunk(ptr, len, &cr);
+}
@@ -0,0 +1,296 @@
+/***************************************************
+ * abccas - ABC 80 casette encoder library
+ *
+ * An encoder (abc_encoder_t) holds the audio format and the
+ * precomputed sample tables, it is read only once initialized and
+ * may be shared by any number of tapes on any number of threads.
+ * A tape (abc_tape_t) is one output stream, it writes through a
+ * sink (abc_sink_t) that is a memory buffer, a file descriptor,
+ * a FILE* or a callback.
+ *
+ * Functions returning int return 0 on success and -1 with errno
+ * set on failure.
+ ****************************************************/
+#ifndef __ABCCAS_H__
+#define __ABCCAS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define STX  0x02
+#define ETX  0x03
+#define SYNC 0x16
+
+#define AUDIO_FORMAT_UNDEF -1
+#define AUDIO_FORMAT_RAW   0
+#define AUDIO_FORMAT_WAV   1
+#define AUDIO_FORMAT_AU    2
+#define AUDIO_FORMAT_FLAC  3   // built from the edges, not with -e
+#define DEFAULT_AUDIO_FORMAT AUDIO_FORMAT_WAV
+
+#define DEFAULT_SAMPLE_RATE      11200
+#define DEFAULT_BAUD             700
+#define DEFAULT_BITS_PER_CHANNEL 8
+#define DEFAULT_NUM_CHANNELS     1
+#define MAX_CHANNELS             64  // abc_encode_channels
+#define LOW_LEVEL -0.504
+#define HIGH_LEVEL 0.678
+
+#define MAX_HBITSZ 128
+
+// band limited steps for the exact rate mode, a step is spread over
+// 2*BLEP_WIDTH samples and the edge position is kept to 1/BLEP_PHASES
+// of a sample
+#define BLEP_WIDTH  8
+#define BLEP_PHASES 256
+
+#define BLOCK_DATA_SIZE 253  // data bytes in a data block
+
+// write 32 + 3 + 1 + 256 + 1 + 2
+//       0  sync stx  data etx checksum
+//
+// the leader of zero bytes can be set per tape, the first block and
+// the later ones (the gap between blocks) separately
+#define LEADER_SIZE 32
+#define MAX_LEADER  255
+#define FRAME_BLOCK_SIZE (3+1+256+1+2)
+#define FRAME_SIZE (LEADER_SIZE+FRAME_BLOCK_SIZE)
+#define MAX_FRAME_SIZE (MAX_LEADER+FRAME_BLOCK_SIZE)
+
+typedef union {
+    uint8_t  u8;
+    uint16_t u16;
+    uint8_t  u24[3];
+    uint32_t u32;
+    uint8_t  data[4];
+} sample_t;
+
+typedef struct {
+    uint8_t header[3];
+    uint8_t name[8];
+    uint8_t ext[3];  // "BAS" | "BAC" etc
+    uint8_t pad[256-(3+8+3)];  // zero!
+} name_block_t;
+
+typedef struct {
+    uint8_t  pad;
+    uint16_t blcnt;     // 16 bit block counter
+    uint8_t  data[BLOCK_DATA_SIZE];
+} __attribute__((packed)) data_block_t;
+
+typedef struct abc_sink abc_sink_t;
+
+// callback sink, return 0 or -1
+typedef int (*abc_write_t)(void* arg, const void* ptr, size_t len);
+
+struct abc_sink {
+    int (*write)(abc_sink_t* sink, const void* ptr, size_t len);
+    int (*seek)(abc_sink_t* sink, int64_t pos);  // NULL = not seekable
+    int64_t  pos;        // current write position
+    void*    arg;        // FILE* or callback argument
+    abc_write_t callback;
+    int      fd;
+    uint8_t* buf;        // memory sink buffer
+    size_t   size;       // allocated size of buf
+    size_t   len;        // bytes in buf
+    int      grow;       // buf is malloc'd by the sink and grows
+};
+
+typedef struct {
+    int baud;
+    int sample_rate;      // adjusted to an even number of samples per bit
+    int exact;            // sample_rate as given, edges between samples
+    int hbitsz;           // samples per half bit (rounded down if exact)
+    int bitsz;            // samples per bit
+    int audio_format;
+    int bits_per_channel;
+    int num_channels;
+    int leader;           // zero bytes before the first block
+    int gap;              // zero bytes before the later blocks
+    uint16_t frame_size;
+    const struct abc_kernel* kernel;  // sample layout, see abccas.c
+    sample_t wl;          // low level sample
+    sample_t wh;          // high level sample
+    // phase after each byte value for both starting phases,
+    // index is (bx << 8) | byte
+    uint8_t  byte_phase[2*256];
+    // exact mode, level amplitudes and the band limited step for
+    // each fractional edge position
+    float level[2];
+    float blep[BLEP_PHASES][2*BLEP_WIDTH];
+} abc_encoder_t;
+
+// Edge timeline of one framed block. The signal only changes level
+// on half bit boundaries: every bit starts with an edge and a "1" has
+// one more in the middle. A block is the level before it and the half
+// bit times of its edges, samples are expanded from it on demand.
+// room for the longest leader and one spare edge slot
+#define TIMELINE_HALF_BITS (MAX_FRAME_SIZE*16+1)
+
+typedef struct {
+    int64_t  t0;          // half bit time of the block on the tape
+    uint8_t  bx;          // level before the first edge
+    uint8_t  bx_end;      // level after the last edge
+    uint16_t nhalf;       // length in half bits
+    uint16_t nedges;
+    uint16_t edge[TIMELINE_HALF_BITS];  // half bit index of each edge
+} abc_timeline_t;
+
+// run statistics, seconds spent in each stage and counters
+#define ABC_STAGE_READ    0   // input read
+#define ABC_STAGE_KONVERT 1   // \n to \r
+#define ABC_STAGE_FRAME   2   // block framing (and phase prefix)
+#define ABC_STAGE_RENDER  3   // timeline to samples
+#define ABC_STAGE_HEADER  4   // audio header write and patch
+#define ABC_STAGE_WRITE   5   // sample writes to the sink
+#define ABC_STAGE_FLUSH   6   // final write, flush and close
+#define ABC_STAGE_VERIFY  7   // loopback check of the samples
+#define ABC_NUM_STAGES    8
+
+typedef struct {
+    double   time[ABC_NUM_STAGES];
+    double   wall;            // whole run
+    uint64_t input_bytes;
+    uint64_t output_bytes;    // through the sink, header included
+    uint64_t samples;
+    uint64_t blocks;
+    uint64_t write_calls;     // sink writes
+    uint64_t files;
+} abc_stats_t;
+
+// Loopback check of rendered samples. The tape layout is known, so
+// instead of searching for edges one sample is read in the middle of
+// every half bit, its sign is the level. A bit must start with a level
+// change, the bytes of each block are checked against the framing:
+// leader, SYNC, STX, block counter, ETX and checksum.
+typedef struct {
+    abc_encoder_t* enc;
+    int64_t  pos;         // samples seen
+    int64_t  at;          // sample in the middle of the next half bit
+    uint32_t rem;         // and the fraction of a sample, in 1/den
+    uint32_t step;        // samples from one half bit to the next
+    uint32_t frac;        // and the fraction, in 1/den
+    uint32_t den;
+    int      msb;         // offset of the top byte of a sample
+    uint32_t flip;        // top bits to levels, 0xffff if set is low
+    int      nhalf;       // half bits of the byte read
+    uint32_t bits;        // their levels, the first in bit 0
+    int      level;       // level of the last half bit, -1 = none
+    int      bad;         // the current block has a mismatch
+    int64_t  blk;         // block being read
+    size_t   len;         // bytes of it read
+    size_t   flen;        // framed length of it
+    uint8_t  frame[MAX_FRAME_SIZE];
+    int64_t  nblocks;     // blocks read
+    int64_t  nbad;        // blocks with a mismatch
+    char     error[96];   // first mismatch, "" if none
+} abc_verify_t;
+
+typedef struct {
+    abc_encoder_t* enc;
+    abc_sink_t* sink;
+    abc_stats_t* stats;   // NULL when not collected
+    char name[8];         // cassette file name
+    char ext[3];          // "BAS" | "BAC" etc
+    int bx;               // square wave phase
+    int blcnt;            // next data block number
+    int nblocks;          // blocks transmitted, name block included
+    int64_t hdrpos;       // sink position of the audio header
+    int64_t trailer;      // bytes of wav chunks after the samples
+    int ds64;             // wav header has room for RF64 sizes, -1 =
+                          // decided by the first abc_write_header
+    abc_timeline_t prev;  // last block, edges reach into the next (exact)
+    abc_verify_t* verify; // NULL or checks every rendered sample
+} abc_tape_t;
+
+// one program of a tape image, start and nblocks are set by
+// abc_encode_image
+typedef struct {
+    const char* filename; // gives the tape name
+    const char* buf;
+    size_t len;
+    char name[8];
+    char ext[3];
+    int64_t start;        // first sample of the program
+    int nblocks;          // name block included
+} abc_program_t;
+
+// sinks
+extern void abc_sink_file(abc_sink_t* sink, FILE* f);
+extern void abc_sink_fd(abc_sink_t* sink, int fd);
+extern void abc_sink_memory(abc_sink_t* sink, void* buf, size_t size);
+extern void abc_sink_callback(abc_sink_t* sink, abc_write_t cb, void* arg);
+extern void abc_sink_free(abc_sink_t* sink);
+
+// encoder
+extern int abc_encoder_init(abc_encoder_t* enc, int audio_format,
+			    int bits_per_channel, int baud, int rate);
+extern int abc_encoder_init_exact(abc_encoder_t* enc, int audio_format,
+				  int bits_per_channel, int baud, int rate);
+extern int abc_encoder_set_leader(abc_encoder_t* enc, int leader, int gap);
+extern void abc_encoder_free(abc_encoder_t* enc);
+extern int64_t abc_num_blocks(size_t len);
+extern int64_t abc_num_samples(abc_encoder_t* enc, int64_t numblk);
+extern size_t abc_frame_len(abc_encoder_t* enc, int64_t blk);
+extern int64_t abc_block_time(abc_encoder_t* enc, int64_t blk);
+
+// tape
+extern void abc_tape_init(abc_tape_t* tape, abc_encoder_t* enc,
+			  abc_sink_t* sink);
+extern int abc_konv_name(const char* filename);
+extern void abc_tape_set_name(abc_tape_t* tape, const char* filename,
+			      int* konv);
+extern int abc_write_header(abc_tape_t* tape, int64_t numsamp);
+extern int abc_patch_header(abc_tape_t* tape);
+extern int abc_transmit_block(abc_tape_t* tape, uint8_t* buf);
+extern int abc_transmit_name_block(abc_tape_t* tape);
+extern int abc_transmit_data_block(abc_tape_t* tape, const char* buf,
+				   size_t len);
+extern int abc_transmit_data_blocks(abc_tape_t* tape, const char* buf,
+				    size_t len);
+extern int abc_transmit_blocks_parallel(abc_tape_t* tape, const char* buf,
+					size_t len, int jobs, uint8_t* out);
+extern int abc_encode(abc_encoder_t* enc, abc_sink_t* sink,
+		      const char* filename, const char* buf, size_t len);
+extern int abc_encode_image(abc_encoder_t* enc, abc_sink_t* sink, int nprog,
+			    abc_program_t* prog, int64_t gap,
+			    abc_stats_t* stats);
+extern void abc_image_index(abc_encoder_t* enc, abc_program_t* prog,
+			    int nprog, FILE* f);
+extern int abc_encode_channels(abc_encoder_t* enc, abc_sink_t* sink, int nch,
+			       char** filenames, char** bufs, size_t* lens,
+			       abc_stats_t* stats);
+
+// loopback check
+extern int abc_verify_init(abc_verify_t* v, abc_encoder_t* enc);
+extern void abc_verify_samples(abc_verify_t* v, const uint8_t* ptr,
+			       size_t count);
+extern int abc_verify_end(abc_verify_t* v, int64_t nblocks);
+
+// statistics
+extern double abc_now(void);
+extern void abc_stats_add(abc_stats_t* dst, abc_stats_t* src);
+extern void abc_stats_report(abc_stats_t* stats, FILE* f);
+
+// framing
+extern uint16_t abc_checksum16(uint8_t* ptr, size_t len);
+extern size_t abc_frame_block(uint8_t* buf, int leader, uint8_t* frame);
+extern void abc_make_name_block(abc_tape_t* tape, name_block_t* block);
+extern void abc_make_data_block(int cnt, const char* buf, size_t len,
+				data_block_t* block);
+extern int abc_timeline_build(abc_timeline_t* tl, const uint8_t* frame,
+			      size_t len, int bx, int64_t t0);
+extern size_t abc_timeline_render(abc_encoder_t* enc, abc_timeline_t* prev,
+				  abc_timeline_t* tl, size_t start,
+				  size_t count, uint8_t* out);
+extern size_t abc_timeline_samples(abc_encoder_t* enc, abc_timeline_t* tl);
+extern int64_t abc_render_samples(abc_encoder_t* enc, abc_timeline_t* tl,
+				  int nblk, int64_t start, int64_t count,
+				  uint8_t* out);
+extern int abc_render_frame(abc_encoder_t* enc, uint8_t* frame, size_t len,
+			    int bx, uint8_t* out);
+extern size_t abc_konvert_line(char* ptr, size_t len);
+extern size_t abc_konvert_chunk(char* ptr, size_t len, int* cr);
+
+#endif
@@ -9,392 +9,2472 @@
  *         -k             translate \n to \r
  *         -b 700|2400    baud rate (700)
  *         -r >1400       audio file sample rate (11200)
- *         -f wav|au|raw  audio format (wav)
+ *         -e             keep the exact sample rate, edges between
+ *                        samples are rendered as band limited steps
+ *         -f wav|au|raw|flac  audio format (wav), flac is encoded
+ *                        from the edges (not with -e, -m, -j, -C, -T)
  *         -z 8|16|24|32  bits per channel (8)
  *         -o <filename>  audio output filename (stdout)
+ *         -m             render into memory (mmap) and write once
+ *         -j <n>         render blocks on n threads, 0 = all cores (-m)
+ *                        with -B/-l, encode n files at a time
+ *         -d             decode audio <file> back to the original file
+ *         -B             batch, encode every <file> to <file>.<format>
+ *                        in the -o directory (or next to <file>),
+ *                        -j files are encoded concurrently
+ *         -l <manifest>  batch, encode "<file> [<output>]" lines
+ *         -C             encode every <file> into its own channel of
+ *                        one output, padded to the longest
+ *         -T <ms>        tape image, every <file> one after the other
+ *                        with <ms> silence between, indexed with wav
+ *                        cue points or an <output>.idx file
+ *         -S <file>      write stage times and counters as JSON
+ *                        to file, - is stderr
+ *         -L <n>[,<m>]   n zero bytes before the first block and m
+ *                        before the others (32,32), the written tape
+ *                        is decoded and checked
+ *         -P             pipelined, input is read and output written
+ *                        on threads of their own, for use as a filter
+ *         -R <ms>        real time, output is paced to the sample rate
+ *                        and kept at most <ms> ahead, underruns and
+ *                        latency are reported (implies -P)
+ *         -I             incremental, only the blocks that changed
+ *                        since the last run (<output>.abcm) are
+ *                        rendered into the -o output
+ *         -D <socket>    daemon, encode jobs sent to the unix socket,
+ *                        with -o <dir> the audio is cached in dir
+ *         -U <socket>    client, encode <file> with the daemon
+ *         --verify       the rendered samples are read back in
+ *                        process at the known bit times and every
+ *                        block is checked (not flac, -C, -T)
  *
  * generates <file>[.bac|.bas].[wav|au] (-o option only) 
  * which can be loaded by ABC80 (LOAD CAS:)
  * Filename in the transmitted data is based on original 
  * filename (uppercase of first 8 char in basename)
+ *
+ * The encoder itself lives in abccas.c (libabccas), see abccas.h.
+ *
+ * with -d a wav, au or raw (-r, -z) audio file is decoded and the
+ * original file is written to the name in the tape name block,
+ * or to the -o filename. -k translates \r back to \n.
  ****************************************************/
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+#include "abccas.h"
 #include "wav.h"
 #include "au.h"
+#include "ring.h"
+#include "sha256.h"
+
+// uint8_t block[256];
+char* progname = "abccas2";
+char outname[FILENAME_MAX+1];
+
+int baud = DEFAULT_BAUD;   // baud
+
+int verbose = 0;
+int check = 0;    // decode the written tape and check it (-L)
+int pipeline = 0; // read, encode and write on their own threads (-P)
+int lookahead_ms = 0;  // pace the output to the sample clock (-R)
+int verify = 0;   // read the rendered samples back (--verify)
+
+// read all of fin into a malloc'd buffer
+char* read_input(FILE* fin, size_t* lenp)
+{
+    size_t size = 64*1024;
+    size_t len = 0;
+    size_t n;
+    char* buf = NULL;
+
+    do {
+	if ((len == size) || (buf == NULL)) {
+	    char* nbuf;
+	    if (buf != NULL)
+		size *= 2;
+	    if ((nbuf = realloc(buf, size)) == NULL) {
+		fprintf(stderr, "%s: unable to allocate %ld bytes (%s)\n",
+			progname, size, strerror(errno));
+		exit(1);
+	    }
+	    buf = nbuf;
+	}
+	len += (n = fread(buf+len, sizeof(char), size-len, fin));
+    } while(n > 0);
+    *lenp = len;
+    return buf;
+}
+
+// Map a regular input file copy on write, konvert only copies the
+// pages it changes and full blocks are framed where they
+// are. Return NULL if fin can not be mapped (pipe, terminal, empty
+// file) and the caller should read it instead.
+char* map_input(FILE* fin, size_t* lenp, void** map, size_t* map_len)
+{
+    struct stat st;
+    int fd = fileno(fin);
+    off_t offs;
+    char* ptr;
+
+    if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode))
+	return NULL;
+    if (((offs = ftello(fin)) < 0) || (st.st_size <= offs))
+	return NULL;
+    ptr = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED)
+	return NULL;
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+    *map = ptr;
+    *map_len = st.st_size;
+    *lenp = st.st_size - offs;
+    return ptr + offs;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: %s [<options>] [<file>[.bas|.bac|other]]...\n",
+	    progname);
+    fprintf(stderr, "OPTIONS\n");
+    fprintf(stderr, "    -h               help\n");
+    fprintf(stderr, "    -v               verbose\n");    
+    fprintf(stderr, "    -k               konvert \\n to \\r\n");
+    fprintf(stderr, "    -b (700)|2400    baud rate\n");
+    fprintf(stderr, "    -r >1400         audio sample rate\n");
+    fprintf(stderr, "    -e               exact sample rate (band limited)\n");
+    fprintf(stderr, "    -f (wav)|au|raw|flac  audio format\n");
+    fprintf(stderr, "    -z (8)|16|24|32  audio bits per channel\n");
+    fprintf(stderr, "    -o <filename>    audio output filename\n");
+    fprintf(stderr, "    -m               render in memory, single write\n");
+    fprintf(stderr, "    -j <n>           render on n threads (0=all cores)\n");
+    fprintf(stderr, "    -d               decode audio to file\n");
+    fprintf(stderr, "    -B               batch encode all files\n");
+    fprintf(stderr, "    -l <manifest>    batch encode files in manifest\n");
+    fprintf(stderr, "    -C               each file in its own channel of one output\n");
+    fprintf(stderr, "    -T <ms>          tape image, all files with <ms> silence between\n");
+    fprintf(stderr, "    -S <file>        write run statistics as json (-=stderr)\n");
+    fprintf(stderr, "    -L <n>[,<m>]     leader n, gap m zero bytes (32), check tape\n");
+    fprintf(stderr, "    -P               read, encode and write on separate threads\n");
+    fprintf(stderr, "    -R <ms>          real time output, <ms> ahead of the sample clock (-P)\n");
+    fprintf(stderr, "    -I               incremental, render only blocks changed since the last run\n");
+    fprintf(stderr, "    -D <socket>      encode daemon, -o <dir> caches the audio\n");
+    fprintf(stderr, "    -U <socket>      encode with the daemon\n");
+    fprintf(stderr, "    --verify         read back and check every rendered block\n");
+    exit(1);
+}
+
+// Map the payload part of a seekable output file, the header has
+// already been written with stdio. Return NULL if fout can not be mapped
+// (pipe, terminal) and the caller should use a plain buffer instead.
+uint8_t* map_output(FILE* fout, size_t len, void** map, size_t* map_len)
+{
+    struct stat st;
+    int fd = fileno(fout);
+    off_t offs;
+    uint8_t* ptr;
+
+    if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode))
+	return NULL;
+    fflush(fout);
+    if ((offs = ftello(fout)) < 0)
+	return NULL;
+    if (ftruncate(fd, offs+len) < 0)
+	return NULL;
+    ptr = mmap(NULL, offs+len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+	return NULL;
+    *map = ptr;
+    *map_len = offs+len;
+    return ptr + offs;
+}
+
+// Decoder, audio back to the original file.
+// The two signal levels of each chunk are the mean of the samples
+// above and below the midpoint of min and max. Channel 0 is compared
+// with the middle of the levels, with hysteresis of a quarter of the
+// swing, this follows a DC offset and rejects noise. The square wave
+// is polarity free so the meaning of the levels does not matter.
+// Every bit starts with an edge, a "0" is one full bit interval and
+// a "1" is two half bit intervals.
+
+#define DEC_HUNT  0   // looking for SYNC SYNC STX
+#define DEC_BLOCK 1   // reading block, ETX and checksum
 
-#define STX  0x02
-#define ETX  0x03
-#define SYNC 0x16
-
-#define AUDIO_FORMAT_UNDEF -1
-#define AUDIO_FORMAT_RAW   0
-#define AUDIO_FORMAT_WAV   1
-#define AUDIO_FORMAT_AU    2
-#define DEFAULT_AUDIO_FORMAT AUDIO_FORMAT_WAV
-
-#define DEFAULT_SAMPLE_RATE      11200
-#define DEFAULT_BAUD             700
-#define DEFAULT_BITS_PER_CHANNEL 8
-#define DEFAULT_NUM_CHANNELS     1
-#define LOW_LEVEL -0.504
-#define HIGH_LEVEL 0.678
-
-typedef union {
-    uint8_t  u8;
-    uint16_t u16;
-    uint8_t  u24[3];
-    uint32_t u32;
-    uint8_t  data[4];
-} sample_t;
+#define DEC_CHUNK 4096  // frames per read
+// shortest leaders (zero bytes) the tape check accepts, the ABC80
+// locks on the bit rate in the first leader and checks and stores a
+// block before it looks for the next SYNC
+#define CHECK_MIN_LEADER 8
+#define CHECK_MIN_GAP    4
+#define DEC_PROBE 32    // intervals used to detect baud rate
 
 typedef struct {
-    uint8_t header[3];
-    uint8_t name[8];
-    uint8_t ext[3];  // "BAS" | "BAC" etc
-    uint8_t pad[256-(3+8+3)];  // zero!
-} name_block_t;
+    uint32_t rate;       // sample rate
+    int      bits;       // bits per channel
+    int      channels;
+    int      big;        // big endian samples
+} audio_info_t;
 
 typedef struct {
-    uint8_t  pad;
-    uint16_t blcnt;     // 16 bit block counter
-    uint8_t  data[253];
-} data_block_t;
+    uint32_t rate;
+    double   hb;          // half bit in samples, 0 = detect from leader
+    int      level;       // level of last sample
+    int64_t  lo;          // level goes to 0 below lo
+    int64_t  hi;          // level goes to 1 above hi
+    int64_t  pos;         // sample position of next sample
+    int64_t  edge;        // sample position of last edge, -1 = none
+    int64_t  probe[DEC_PROBE]; // first intervals, while detecting baud
+    int      nprobe;
+    int      half;        // got first half of a "1"
+    uint32_t win;         // last 32 bits, latest bit in msb
+    int      state;
+    int      nbits;       // bits received of block
+    int      lead;        // bits received while hunting
+    int      min_lead[2]; // shortest leader in bytes, first and later blocks
+    uint8_t  frame[256+1+2];  // block, ETX, checksum
+    int      blocks;      // good blocks
+    int      errors;      // bad or missing blocks
+    int      blcnt;       // next expected block counter
+    int      named;       // got name block
+    uint8_t  name[8];
+    uint8_t  ext[3];
+    uint8_t* data;        // decoded file
+    size_t   len;
+    size_t   size;
+} decoder_t;
 
-// uint8_t block[256];
-char* progname = "abccas2";
-char outname[FILENAME_MAX+1];
+static void decode_block(decoder_t* dec)
+{
+    uint8_t* blk = dec->frame;
+    uint16_t csum = abc_checksum16(blk, 256) + ETX;
+    uint16_t rsum = blk[257] | (blk[258] << 8);
+    int cnt;
+
+    if ((blk[256] != ETX) || (csum != rsum)) {
+	fprintf(stderr, "%s: bad block at sample %ld (%s)\n",
+		progname, dec->edge,
+		(blk[256] != ETX) ? "no ETX" : "checksum");
+	dec->errors++;
+	return;
+    }
+    if ((blk[0] == 0xff) && (blk[1] == 0xff) && (blk[2] == 0xff)) {
+	name_block_t* nb = (name_block_t*) blk;
+	memcpy(dec->name, nb->name, sizeof(dec->name));
+	memcpy(dec->ext, nb->ext, sizeof(dec->ext));
+	dec->named = 1;
+	if (verbose)
+	    fprintf(stderr, "%s: name block %.8s.%.3s\n",
+		    progname, dec->name, dec->ext);
+    }
+    else {
+	data_block_t* db = (data_block_t*) blk;
+	cnt = blk[1] | (blk[2] << 8);
+	if (cnt < dec->blcnt) {  // repeated block
+	    if (verbose)
+		fprintf(stderr, "%s: skip block #%d\n", progname, cnt);
+	    return;
+	}
+	if (cnt > dec->blcnt) {
+	    fprintf(stderr, "%s: missing block #%d..#%d\n",
+		    progname, dec->blcnt, cnt-1);
+	    dec->errors++;
+	}
+	if (dec->len + sizeof(db->data) > dec->size) {
+	    size_t size = dec->size ? 2*dec->size : 64*1024;
+	    uint8_t* data;
+	    if ((data = realloc(dec->data, size)) == NULL) {
+		fprintf(stderr, "%s: unable to allocate %ld bytes (%s)\n",
+			progname, size, strerror(errno));
+		exit(1);
+	    }
+	    dec->data = data;
+	    dec->size = size;
+	}
+	memcpy(dec->data + dec->len, db->data, sizeof(db->data));
+	dec->len += sizeof(db->data);
+	dec->blcnt = cnt+1;
+	if (verbose > 1)
+	    fprintf(stderr, "%s: data block #%d\n", progname, cnt);
+    }
+    dec->blocks++;
+}
+
+static void decode_bit(decoder_t* dec, int bit)
+{
+    dec->win = (dec->win >> 1) | ((uint32_t) bit << 31);
+    if (dec->state == DEC_HUNT) {
+	dec->lead++;
+	if ((dec->win >> 8) == (SYNC | (SYNC << 8) | (STX << 16))) {
+	    int k = (dec->blocks + dec->errors) > 0;
+	    int n = (dec->lead - 32 + 7) / 8;  // before SYNC SYNC SYNC STX
+	    if (n < dec->min_lead[k])
+		dec->min_lead[k] = n;
+	    dec->state = DEC_BLOCK;
+	    dec->nbits = 0;
+	}
+    }
+    else if ((++dec->nbits & 7) == 0) {
+	dec->frame[(dec->nbits >> 3)-1] = dec->win >> 24;
+	if (dec->nbits == 8*sizeof(dec->frame)) {
+	    decode_block(dec);
+	    dec->state = DEC_HUNT;
+	    dec->win = 0;
+	    dec->lead = 0;
+	}
+    }
+}
+
+static void decode_interval(decoder_t* dec, int64_t n)
+{
+    if (n > 3*dec->hb) {        // gap, silence or noise
+	// the bit before it ends here, a "1" if its half was seen
+	decode_bit(dec, dec->half);
+	dec->half = 0;
+    }
+    else if (n < 1.5*dec->hb) { // half bit
+	if (dec->half) {
+	    dec->half = 0;
+	    decode_bit(dec, 1);
+	}
+	else
+	    dec->half = 1;
+    }
+    else {                      // full bit
+	dec->half = 0;
+	decode_bit(dec, 0);
+    }
+}
+
+static int cmp_int64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*) a;
+    int64_t y = *(const int64_t*) b;
+    return (x > y) - (x < y);
+}
+
+// The leader is all "0" bits, so the median of the first intervals
+// is one bit, pick the closest of the supported baud rates.
+static void decode_probe(decoder_t* dec)
+{
+    int64_t sorted[DEC_PROBE];
+    double bitrate;
+    int i;
+
+    memcpy(sorted, dec->probe, sizeof(sorted));
+    qsort(sorted, DEC_PROBE, sizeof(int64_t), cmp_int64);
+    bitrate = (double) dec->rate / sorted[DEC_PROBE/2];
+    baud = (bitrate < (700+2400)/2) ? 700 : 2400;
+    dec->hb = (double) dec->rate / (2*baud);
+    if (verbose)
+	fprintf(stderr, "%s: detected baud=%d\n", progname, baud);
+    for (i = 0; i < DEC_PROBE; i++)
+	decode_interval(dec, dec->probe[i]);
+}
+
+static inline void decode_edge(decoder_t* dec, int64_t pos)
+{
+    int64_t n = pos - dec->edge;
+
+    if (dec->edge < 0) {
+	dec->edge = pos;
+	return;
+    }
+    dec->edge = pos;
+    if (dec->hb > 0)
+	decode_interval(dec, n);
+    else {
+	dec->probe[dec->nprobe++] = n;
+	if (dec->nprobe == DEC_PROBE)
+	    decode_probe(dec);
+    }
+}
+
+// find the level changes in lv[0..n)
+static void decode_levels(decoder_t* dec, uint8_t* lv, int n)
+{
+    int i;
+
+    if (n == 0)
+	return;
+    if (lv[0] != dec->level)
+	decode_edge(dec, dec->pos);
+    i = 1;
+#ifdef __SSE2__
+    for (; i+16 <= n; i += 16) {
+	__m128i a = _mm_loadu_si128((__m128i*) (lv+i));
+	__m128i b = _mm_loadu_si128((__m128i*) (lv+i-1));
+	int m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+	while(m) {
+	    decode_edge(dec, dec->pos + i + __builtin_ctz(m));
+	    m &= m-1;
+	}
+    }
+#endif
+    for (; i < n; i++) {
+	if (lv[i] != lv[i-1])
+	    decode_edge(dec, dec->pos + i);
+    }
+    dec->level = lv[n-1];
+    dec->pos += n;
+}
+
+// sample value of channel 0 scaled to 32 bits signed
+static inline int32_t decode_sample(uint8_t* ptr, int bytes, int big)
+{
+    uint32_t x = 0;
+    int i;
+
+    if (bytes == 1)  // wav is u8, au and raw are s8
+	return (int32_t) ((uint32_t) (big ? ptr[0] : ptr[0] ^ 0x80) << 24);
+    for (i = 0; i < bytes; i++)
+	x = (x << 8) | ptr[big ? i : bytes-1-i];
+    return (int32_t) (x << (32-8*bytes));
+}
+
+// read the wav/au header, tag is the first 4 bytes of the file
+// anything else is raw samples as given by -r and -z
+static int decode_header(FILE* fin, uint32_t tag, audio_info_t* info)
+{
+    uint32_t len;
+    uint8_t skip[256];
+
+    if ((tag == WAV_ID_RIFF) || (tag == WAV_ID_RF64)) {  // ds64 is skipped
+	info->big = 0;
+	read_u32le(fin);
+	if ((read_tag(fin, &tag) != 1) || (tag != WAV_ID_WAVE))
+	    return -1;
+	while(read_tag(fin, &tag) == 1) {
+	    len = read_u32le(fin);
+	    if (tag == WAV_ID_DATA)
+		return 0;
+	    if (tag == WAV_ID_FMT) {
+		read_u16le(fin);  // AudioFormat
+		info->channels = read_u16le(fin);
+		info->rate = read_u32le(fin);
+		read_u32le(fin);  // ByteRate
+		read_u16le(fin);  // FrameSize
+		info->bits = read_u16le(fin);
+		len -= 16;
+	    }
+	    len += (len & 1);  // chunks are word aligned
+	    while(len > 0) {
+		size_t n = (len > sizeof(skip)) ? sizeof(skip) : len;
+		if (fread(skip, 1, n, fin) != n)
+		    return -1;
+		len -= n;
+	    }
+	}
+	return -1;
+    }
+    else if (tag == AU_MAGIC) {
+	uint32_t offset = read_u32be(fin);
+	info->big = 1;
+	read_u32be(fin);  // data_size
+	switch(read_u32be(fin)) {
+	case AU_ENCODING_LINEAR_8:  info->bits = 8; break;
+	case AU_ENCODING_LINEAR_16: info->bits = 16; break;
+	case AU_ENCODING_LINEAR_24: info->bits = 24; break;
+	case AU_ENCODING_LINEAR_32: info->bits = 32; break;
+	default: return -1;
+	}
+	info->rate = read_u32be(fin);
+	info->channels = read_u32be(fin);
+	for (len = 24; len < offset; len++)
+	    if (fgetc(fin) == EOF)
+		return -1;
+	return 0;
+    }
+    return 1;  // raw
+}
+
+// decode the audio in fin into dec, return -1 if it is not audio
+static int decode_audio(FILE* fin, decoder_t* dec, int rate,
+			int bits_per_channel, int baud_given)
+{
+    audio_info_t info;
+    uint32_t tag = 0;
+    uint8_t* buf;
+    uint8_t lv[DEC_CHUNK];
+    size_t fsize, bsize, n, i;
+    int32_t val[DEC_CHUNK];
+    int raw, bytes, l;
+
+    memset(dec, 0, sizeof(decoder_t));
+    info.rate = rate;
+    info.bits = bits_per_channel;
+    info.channels = 1;
+    info.big = 1;  // raw output is written with au samples
+    if (fread(&tag, sizeof(tag), 1, fin) != 1) {
+	fprintf(stderr, "%s: no input\n", progname);
+	return -1;
+    }
+    big32(&tag);
+    if ((raw = decode_header(fin, tag, &info)) < 0) {
+	fprintf(stderr, "%s: bad or unsupported audio header\n", progname);
+	return -1;
+    }
+    if ((info.bits < 8) || (info.bits > 32) || (info.bits & 7) ||
+	(info.channels < 1) || (info.rate < 1400)) {
+	fprintf(stderr, "%s: unsupported audio format %d bits, %d channels,"
+		" rate %u\n", progname, info.bits, info.channels, info.rate);
+	return -1;
+    }
+    bytes = info.bits/8;
+    fsize = info.channels*bytes;
+
+    dec->rate = info.rate;
+    dec->edge = -1;
+    dec->min_lead[0] = dec->min_lead[1] = MAX_LEADER+1;
+    if (baud_given)
+	dec->hb = (double) info.rate / (2*baud);
+    if (verbose)
+	fprintf(stderr, "%s: decode %s rate=%u bits=%d channels=%d\n",
+		progname, raw ? "raw" : (info.big ? "au" : "wav"),
+		info.rate, info.bits, info.channels);
+
+    bsize = DEC_CHUNK*fsize;
+    if ((buf = malloc(bsize)) == NULL) {
+	fprintf(stderr, "%s: unable to allocate %ld bytes (%s)\n",
+		progname, bsize, strerror(errno));
+	exit(1);
+    }
+    n = 0;
+    if (raw) {  // the tag bytes are samples
+	big32(&tag);
+	memcpy(buf, &tag, sizeof(tag));
+	n = sizeof(tag);
+    }
+    dec->level = -1;
+    while((n += fread(buf+n, 1, bsize-n, fin)) >= fsize) {
+	size_t nframes = n / fsize;
+	int32_t vmin, vmax;
+
+	vmin = vmax = val[0] = decode_sample(buf, bytes, info.big);
+	for (i = 1; i < nframes; i++) {
+	    val[i] = decode_sample(buf+i*fsize, bytes, info.big);
+	    vmin = (val[i] < vmin) ? val[i] : vmin;
+	    vmax = (val[i] > vmax) ? val[i] : vmax;
+	}
+	if (vmin < vmax) {  // keep the old threshold in silence
+	    int64_t mid = ((int64_t) vmin + vmax) / 2;
+	    int64_t sum[2] = { 0, 0 };
+	    size_t cnt[2] = { 0, 0 };
+	    int64_t h;
+
+	    for (i = 0; i < nframes; i++) {
+		int k = (val[i] > mid);
+		sum[k] += val[i];
+		cnt[k]++;
+	    }
+	    if (cnt[0] && cnt[1]) {
+		sum[0] /= (int64_t) cnt[0];
+		sum[1] /= (int64_t) cnt[1];
+		mid = (sum[0] + sum[1]) / 2;
+		h = (sum[1] - sum[0]) / 4;
+		dec->lo = mid - h;
+		dec->hi = mid + h;
+	    }
+	}
+	if (dec->level < 0)
+	    dec->level = (val[0] > (dec->lo + dec->hi) / 2);
+	l = dec->level;
+	for (i = 0; i < nframes; i++) {
+	    if (val[i] > dec->hi)
+		l = 1;
+	    else if (val[i] < dec->lo)
+		l = 0;
+	    lv[i] = l;
+	}
+	decode_levels(dec, lv, nframes);
+	n -= nframes*fsize;
+	memmove(buf, buf+nframes*fsize, n);
+    }
+    free(buf);
+    // the last bit has no edge after it
+    decode_edge(dec, dec->pos);
+    return 0;
+}
+
+// decode the audio in fin and write the original file
+int decode_file(FILE* fin, char* output_filename, int konv, int rate,
+		int bits_per_channel, int baud_given)
+{
+    decoder_t dec;
+    size_t i;
+    FILE* fout;
+
+    if (decode_audio(fin, &dec, rate, bits_per_channel, baud_given) < 0)
+	return 1;
+
+    if (verbose)
+	fprintf(stderr, "%s: %d blocks, %d errors\n",
+		progname, dec.blocks, dec.errors);
+    if (!dec.named) {
+	fprintf(stderr, "%s: no name block found\n", progname);
+	dec.errors++;
+	memcpy(dec.name, "ABCCAS  ", 8);
+	memcpy(dec.ext, "BAC", 3);
+    }
+    if (dec.blocks == 0) {
+	fprintf(stderr, "%s: no blocks found\n", progname);
+	return 1;
+    }
+    // text is padded with zeros in the last block
+    if (memcmp(dec.ext, "BAS", 3) == 0) {
+	while((dec.len > 0) && (dec.data[dec.len-1] == 0))
+	    dec.len--;
+    }
+    if (konv) {  // translate \r back to \n
+	for (i = 0; i < dec.len; i++)
+	    if (dec.data[i] == '\r')
+		dec.data[i] = '\n';
+    }
+
+    if (output_filename == NULL) {
+	char* ptr = outname;
+	for (i = 0; (i < 8) && (dec.name[i] != ' '); i++)
+	    *ptr++ = (dec.name[i] == '/') ? '_' : tolower(dec.name[i]);
+	*ptr++ = '.';
+	for (i = 0; (i < 3) && (dec.ext[i] != ' '); i++)
+	    *ptr++ = (dec.ext[i] == '/') ? '_' : tolower(dec.ext[i]);
+	*ptr = '\0';
+	output_filename = outname;
+	// do not overwrite, may well be the original
+	fout = fopen(output_filename, "wx");
+    }
+    else
+	fout = fopen(output_filename, "wb");
+    if (fout == NULL) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, output_filename, strerror(errno));
+	return 1;
+    }
+    fwrite(dec.data, 1, dec.len, fout);
+    fclose(fout);
+    if (verbose)
+	fprintf(stderr, "%s: wrote %ld bytes to %s\n",
+		progname, dec.len, output_filename);
+    free(dec.data);
+    return dec.errors ? 1 : 0;
+}
+
+// decode the tape written to filename, every block must be read back
+// and the leaders must be within the limits
+int check_tape(abc_encoder_t* enc, char* filename, int nblocks)
+{
+    decoder_t dec;
+    FILE* f;
+    int err = 0;
+
+    if ((f = fopen(filename, "rb")) == NULL) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, filename, strerror(errno));
+	return -1;
+    }
+    if (decode_audio(f, &dec, enc->sample_rate, enc->bits_per_channel,
+		     1) < 0)
+	err = -1;
+    else if ((dec.errors > 0) || (dec.blocks != nblocks)) {
+	fprintf(stderr, "%s: check %s: %d of %d blocks read back\n",
+		progname, filename, dec.blocks, nblocks);
+	err = -1;
+    }
+    else if ((dec.min_lead[0] < CHECK_MIN_LEADER) ||
+	     ((nblocks > 1) && (dec.min_lead[1] < CHECK_MIN_GAP))) {
+	fprintf(stderr, "%s: check %s: leader %d, gap %d bytes, "
+		"need %d and %d\n", progname, filename, dec.min_lead[0],
+		dec.min_lead[1], CHECK_MIN_LEADER, CHECK_MIN_GAP);
+	err = -1;
+    }
+    else if (verbose)
+	fprintf(stderr, "%s: check %s: %d blocks, leader %d, gap %d bytes\n",
+		progname, filename, dec.blocks, dec.min_lead[0],
+		dec.min_lead[1]);
+    fclose(f);
+    free(dec.data);
+    return err;
+}
+
+// result of the loopback check (--verify), the first mismatch if any
+static int verify_report(abc_verify_t* v, char* filename, int64_t nblocks)
+{
+    if (filename == NULL)
+	filename = "*stdout*";
+    if (abc_verify_end(v, nblocks) < 0) {
+	fprintf(stderr, "%s: verify %s: %s (%ld of %ld blocks bad)\n",
+		progname, filename, v->error, v->nbad, nblocks);
+	return -1;
+    }
+    if (verbose)
+	fprintf(stderr, "%s: verify %s: %ld blocks\n", progname, filename,
+		v->nblocks);
+    return 0;
+}
+
+// loopback check of the nblocks blocks after hdrlen bytes of filename
+static int verify_file(abc_encoder_t* enc, char* filename, size_t hdrlen,
+		       int64_t nblocks, abc_stats_t* st)
+{
+    abc_verify_t v;
+    size_t len = hdrlen + abc_num_samples(enc, nblocks)*enc->frame_size;
+    struct stat sb;
+    uint8_t* ptr;
+    double t0 = abc_now();
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, filename, strerror(errno));
+	return -1;
+    }
+    if (fstat(fd, &sb) < 0) {
+	fprintf(stderr, "%s: unable to stat file %s (%s)\n",
+		progname, filename, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    // mapping past the end of the file would fault on access
+    if ((size_t) sb.st_size < len) {
+	fprintf(stderr, "%s: verify %s: samples missing\n",
+		progname, filename);
+	close(fd);
+	return -1;
+    }
+    ptr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+	fprintf(stderr, "%s: unable to map file %s (%s)\n",
+		progname, filename, strerror(errno));
+	return -1;
+    }
+    abc_verify_init(&v, enc);
+    abc_verify_samples(&v, ptr + hdrlen, (len - hdrlen)/enc->frame_size);
+    munmap(ptr, len);
+    st->time[ABC_STAGE_VERIFY] += abc_now() - t0;
+    return verify_report(&v, filename, nblocks);
+}
+
+// transmit len bytes as data blocks
+int transmit_data_blocks(abc_tape_t* tape, char* buf, size_t len)
+{
+    while (len > 0) {
+	size_t n = (len >= BLOCK_DATA_SIZE) ? BLOCK_DATA_SIZE : len;
+	if (abc_transmit_data_block(tape, buf, n) < 0)
+	    return -1;
+	if (verbose)
+	    fprintf(stderr, "%s: output block len=%ld #%d\n",
+		    progname, n, tape->blcnt-1);
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+// Pipelined encoding (-P). The input is read and konverted by a
+// reader thread and the output written by a writer thread, the
+// encoder runs on the calling thread between them. The stages are
+// connected by rings, so reading, rendering and writing overlap and
+// the header and the name block go out before any input has arrived.
+#define PIPE_IN_RING  (64*1024)
+#define PIPE_OUT_RING (1024*1024)
+
+// Real time output (-R). The writer holds every write until the
+// samples in it are due within lookahead of the sample clock, which
+// starts at the first write. The clock is in output bytes, the audio
+// header counts as a few samples. A write that is due already means
+// the receiver ran out of samples, an underrun, and the clock is moved
+// on by the time lost.
+#define PACE_QUANTUM 0.010  // longest write in seconds
+
+typedef struct {
+    double lookahead;     // seconds
+    double byte_rate;     // output bytes per second
+    size_t quantum;       // bytes per write
+    double t0;            // clock time of output byte 0
+    double first;         // time of the first write
+    uint64_t writes;
+    int underruns;
+    double lost;          // seconds of underrun
+    double ahead_min;     // seconds of samples ahead at a write
+    double ahead_max;
+    double ahead_sum;
+} pace_t;
+
+static void pace_init(pace_t* p, abc_encoder_t* enc, int ms)
+{
+    double q;
+
+    memset(p, 0, sizeof(pace_t));
+    p->lookahead = ms / 1000.0;
+    p->byte_rate = (double) enc->sample_rate * enc->frame_size;
+    q = (p->lookahead/4 < PACE_QUANTUM) ? p->lookahead/4 : PACE_QUANTUM;
+    p->quantum = (size_t) (q*enc->sample_rate) * enc->frame_size;
+    if (p->quantum < enc->frame_size)
+	p->quantum = enc->frame_size;
+    p->ahead_min = p->lookahead;
+}
+
+// wait until the n bytes after the done ones may be written, return
+// how many to write
+static size_t pace_wait(pace_t* p, uint64_t done, size_t n)
+{
+    double now = abc_now();
+    double ahead, due;
+    struct timespec ts;
+
+    if (n > p->quantum)
+	n = p->quantum;
+    if (p->writes++ == 0)
+	p->t0 = p->first = now;
+    if ((ahead = p->t0 + done/p->byte_rate - now) < 0) {
+	p->underruns++;
+	p->lost -= ahead;
+	p->t0 -= ahead;
+	if (verbose)
+	    fprintf(stderr, "%s: underrun %.1f ms at %.3f s\n",
+		    progname, -ahead*1000, done/p->byte_rate);
+    }
+    due = p->t0 + (done + n)/p->byte_rate - p->lookahead;
+    if (due > now) {
+	ts.tv_sec = (time_t) due;
+	ts.tv_nsec = (long) ((due - ts.tv_sec)*1e9);
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	      EINTR)
+	    ;
+    }
+    if (p->writes == 1)  // nothing is ahead of the first write
+	return n;
+    if ((ahead = p->t0 + done/p->byte_rate - abc_now()) < 0)
+	ahead = 0;
+    if (ahead < p->ahead_min)
+	p->ahead_min = ahead;
+    if (ahead > p->ahead_max)
+	p->ahead_max = ahead;
+    p->ahead_sum += ahead;
+    return n;
+}
+
+static void pace_report(pace_t* p, uint64_t bytes, double wall0, FILE* f)
+{
+    fprintf(f, "%s: real time %.3f s, lookahead %.0f ms, "
+	    "first write after %.1f ms\n", progname, bytes/p->byte_rate,
+	    p->lookahead*1000, (p->first - wall0)*1000);
+    fprintf(f, "%s: ahead min %.1f avg %.1f max %.1f ms, "
+	    "%d underruns %.1f ms\n", progname, p->ahead_min*1000,
+	    (p->writes > 1) ? p->ahead_sum/(p->writes-1)*1000 : 0.0,
+	    p->ahead_max*1000, p->underruns, p->lost*1000);
+}
+
+typedef struct {
+    ring_t ring;
+    pthread_t tid;
+    int fd;
+    int konv;
+    abc_sink_t sink;  // writer output
+    uint64_t done;    // bytes written
+    pace_t* pace;     // writer, NULL = as fast as possible
+    abc_stats_t st;   // stage times of the thread
+    int err;          // errno of a failed read or write
+} stage_t;
+
+// read and konvert into the ring until end of input, only read() may
+// be cancelled
+static void* reader_stage(void* arg)
+{
+    stage_t* s = (stage_t*) arg;
+    uint8_t* ptr;
+    ssize_t len;
+    size_t n;
+    int cr = 0;
+    double t0;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    while((n = ring_space(&s->ring, &ptr)) > 0) {
+	t0 = abc_now();
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	len = read(s->fd, ptr, n);
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	s->st.time[ABC_STAGE_READ] += abc_now() - t0;
+	if ((len < 0) && (errno == EINTR))
+	    continue;
+	if (len <= 0) {
+	    if (len < 0)
+		s->err = errno;
+	    break;
+	}
+	s->st.input_bytes += len;
+	if (s->konv) {
+	    t0 = abc_now();
+	    len = abc_konvert_chunk((char*) ptr, len, &cr);
+	    s->st.time[ABC_STAGE_KONVERT] += abc_now() - t0;
+	}
+	ring_put(&s->ring, len);
+    }
+    ring_close(&s->ring);
+    return NULL;
+}
+
+// write what the encoder puts in the ring as soon as it is there,
+// or when it is due (-R)
+static void* writer_stage(void* arg)
+{
+    stage_t* s = (stage_t*) arg;
+    uint8_t* ptr;
+    size_t n;
+    double t0;
+
+    while((n = ring_data(&s->ring, &ptr)) > 0) {
+	if (s->pace != NULL)
+	    n = pace_wait(s->pace, s->done, n);
+	t0 = abc_now();
+	if (s->sink.write(&s->sink, ptr, n) < 0) {
+	    s->err = errno;
+	    break;
+	}
+	s->sink.pos += n;
+	s->done += n;
+	s->st.time[ABC_STAGE_WRITE] += abc_now() - t0;
+	s->st.write_calls++;
+	ring_take(&s->ring, n);
+    }
+    ring_close(&s->ring);  // the encoder fails on its next write
+    return NULL;
+}
+
+static int ring_sink_write(void* arg, const void* ptr, size_t len)
+{
+    return ring_write((ring_t*) arg, ptr, len);
+}
+
+static int stage_start(stage_t* s, size_t size, void* (*run)(void*))
+{
+    if (ring_init(&s->ring, size) < 0)
+	return -1;
+    if ((errno = pthread_create(&s->tid, NULL, run, s)) != 0) {
+	ring_free(&s->ring);
+	return -1;
+    }
+    return 0;
+}
+
+// encode data blocks from the reader ring, full blocks that are
+// contiguous in the ring are framed where they are
+static int transmit_ring(abc_tape_t* tape, ring_t* ring, size_t* lenp)
+{
+    char blkbuf[BLOCK_DATA_SIZE];
+    uint8_t* ptr;
+    size_t n;
+
+    do {
+	if (ring_data(ring, &ptr) >= BLOCK_DATA_SIZE) {
+	    n = BLOCK_DATA_SIZE;
+	    if (transmit_data_blocks(tape, (char*) ptr, n) < 0)
+		return -1;
+	    ring_take(ring, n);
+	}
+	else if ((n = ring_read(ring, blkbuf, sizeof(blkbuf))) > 0) {
+	    if (transmit_data_blocks(tape, blkbuf, n) < 0)
+		return -1;
+	}
+	*lenp += n;
+    } while(n == BLOCK_DATA_SIZE);
+    return 0;
+}
+
+// encode one file, NULL filenames are stdin/stdout, stats may be NULL
+int encode_file(abc_encoder_t* enc, char* input_filename,
+		char* output_filename, int konv, int memory_output, int jobs,
+		abc_stats_t* stats)
+{
+    int64_t numblk, numsamp, numbyte;
+    FILE* fin = stdin;
+    FILE* fout = stdout;
+    abc_sink_t sink;
+    abc_tape_t tape;
+    abc_stats_t st;
+    char* mapbuf;
+    size_t maplen = 0;
+    void* map = NULL;     // mapped input
+    size_t map_len = 0;
+    stage_t rd, wr;       // -P reader and writer
+    abc_sink_t psink;     // -P encoder output, the writer ring
+    pace_t pace;          // -R
+    abc_verify_t vf;      // --verify
+    int streamed = 0;
+    double t0, wall0 = abc_now();
+    int err = 0;
+
+    if (input_filename != NULL) {
+	if ((fin=fopen(input_filename,"rb")) == NULL) {
+	    fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		    progname, input_filename, strerror(errno));
+	    return 1;
+	}
+    }
+
+    if (output_filename != NULL) {
+	// mmap needs read access to the output file
+	fout = fopen(output_filename, memory_output ? "w+b" : "wb");
+	if (fout == NULL) {
+	    fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		    progname, output_filename, strerror(errno));
+	    if (fin != stdin)
+		fclose(fin);
+	    return 1;
+	}
+    }
+    abc_sink_file(&sink, fout);
+    abc_tape_init(&tape, enc, &sink);
+    if (input_filename != NULL)
+	abc_tape_set_name(&tape, input_filename, &konv);
+    memset(&st, 0, sizeof(st));
+    if (stats != NULL)
+	tape.stats = &st;
+    if (verify && (abc_verify_init(&vf, enc) == 0))
+	tape.verify = &vf;
+
+    if (verbose) {
+	fprintf(stderr, "         input_filename = %s\n",
+		input_filename ? input_filename : "*stdin*");
+	fprintf(stderr, "         output_filename = %s\n", output_filename);
+	fprintf(stderr, "         cassete name = %.8s.%.3s\n",
+		tape.name, tape.ext);
+    }
+
+    if (pipeline) {
+	fflush(fout);
+	memset(&wr, 0, sizeof(wr));
+	abc_sink_fd(&wr.sink, fileno(fout));
+	if (lookahead_ms > 0) {
+	    pace_init(&pace, enc, lookahead_ms);
+	    wr.pace = &pace;
+	}
+	if (stage_start(&wr, PIPE_OUT_RING, writer_stage) < 0) {
+	    fprintf(stderr, "%s: unable to start writer (%s)\n",
+		    progname, strerror(errno));
+	    exit(1);
+	}
+	abc_sink_callback(&psink, ring_sink_write, &wr.ring);
+	psink.pos = wr.sink.pos;
+	tape.sink = &psink;
+    }
+
+    // a regular input file is mapped, the header gets the lengths up
+    // front. otherwise the input is streamed and the lengths patched
+    // in at the end, or left unknown if the output is a pipe.
+    t0 = abc_now();
+    mapbuf = map_input(fin, &maplen, &map, &map_len);
+    st.time[ABC_STAGE_READ] += abc_now() - t0;
+    if ((mapbuf != NULL) || memory_output) {
+	char* filebuf = mapbuf;
+	size_t len = maplen;
+
+	if (filebuf == NULL) {
+	    t0 = abc_now();
+	    filebuf = read_input(fin, &len);
+	    st.time[ABC_STAGE_READ] += abc_now() - t0;
+	}
+	st.input_bytes += len;
+	if (verbose)
+	    fprintf(stderr, "input filelen = %ld\n", len);
+	if (konv) {
+	    t0 = abc_now();
+	    len = abc_konvert_line(filebuf, len);
+	    st.time[ABC_STAGE_KONVERT] += abc_now() - t0;
+	}
+	numblk = abc_num_blocks(len);
+	// number of samples(frames) in audio file
+	numsamp = abc_num_samples(enc, numblk);
+	numbyte = numsamp*enc->frame_size;
+
+	if (verbose)
+	    fprintf(stderr, "Size:%ld Blk:%ld Byte:%ld Samp:%ld\n",
+		    len, numblk, numbyte, numsamp);
+	err = abc_write_header(&tape, numsamp);
+	if ((err == 0) && memory_output) {
+	    void* omap = NULL;
+	    size_t omap_len = 0;
+	    uint8_t* buf;
+
+	    if ((buf = map_output(fout, numbyte, &omap, &omap_len)) == NULL) {
+		if ((buf = malloc(numbyte)) == NULL) {
+		    fprintf(stderr, "%s: unable to allocate %ld bytes (%s)\n",
+			    progname, numbyte, strerror(errno));
+		    exit(1);
+		}
+	    }
+	    if (verbose)
+		fprintf(stderr, "%s: render %ld bytes into %s\n",
+			progname, numbyte, omap ? "mmap" : "memory");
+	    if (jobs > 1) {
+		err = abc_transmit_blocks_parallel(&tape, filebuf, len,
+						   jobs, buf);
+		if (verbose)
+		    fprintf(stderr, "%s: rendered %d blocks on %d threads\n",
+			    progname, tape.nblocks, jobs);
+	    }
+	    else {
+		abc_sink_t msink;
+
+		abc_sink_memory(&msink, buf, numbyte);
+		tape.sink = &msink;
+		if ((err = abc_transmit_name_block(&tape)) == 0)
+		    err = transmit_data_blocks(&tape, filebuf, len);
+		tape.sink = &sink;
+	    }
+	    t0 = abc_now();
+	    if (omap != NULL)
+		munmap(omap, omap_len);
+	    else {
+		if (fwrite(buf, sizeof(uint8_t), numbyte, fout) != numbyte)
+		    err = -1;
+		st.write_calls++;
+		free(buf);
+	    }
+	    st.time[ABC_STAGE_FLUSH] += abc_now() - t0;
+	}
+	else if (err == 0) {
+	    if ((err = abc_transmit_name_block(&tape)) == 0)
+		err = transmit_data_blocks(&tape, filebuf, len);
+	}
+	if (map != NULL)
+	    munmap(map, map_len);
+	else
+	    free(filebuf);
+    }
+    else {
+	char blkbuf[BLOCK_DATA_SIZE];
+	size_t len, fill = 0, filelen = 0;
+	struct stat sb;
+	int cr = 0;
+
+	// stream block by block, lengths are patched in at the end.
+	// konverted input is refilled so every block but the last is full
+	streamed = 1;
+	if (pipeline) {
+	    memset(&rd, 0, sizeof(rd));
+	    rd.fd = fileno(fin);
+	    rd.konv = konv;
+	    if (stage_start(&rd, PIPE_IN_RING, reader_stage) < 0) {
+		fprintf(stderr, "%s: unable to start reader (%s)\n",
+			progname, strerror(errno));
+		exit(1);
+	    }
+	}
+	// a wav header only needs room for RF64 sizes if the input may
+	// not fit, konvert never makes it longer. on a pipe the sizes
+	// stay 0xffffffff (unknown) and the room would never be used
+	if (sink.seek == NULL)
+	    tape.ds64 = 0;
+	else if ((fstat(fileno(fin), &sb) == 0) && S_ISREG(sb.st_mode))
+	    tape.ds64 = (abc_num_samples(enc, abc_num_blocks(sb.st_size))*
+			 enc->frame_size > 0xffff0000);
+	if ((err = abc_write_header(&tape, -1)) == 0)
+	    err = abc_transmit_name_block(&tape);
+
+	if (pipeline) {
+	    if (err == 0)
+		err = transmit_ring(&tape, &rd.ring, &filelen);
+	    if (err < 0) {  // the reader may wait for input
+		ring_close(&rd.ring);
+		pthread_cancel(rd.tid);
+	    }
+	    pthread_join(rd.tid, NULL);
+	    ring_free(&rd.ring);
+	    st.time[ABC_STAGE_READ] += rd.st.time[ABC_STAGE_READ];
+	    st.time[ABC_STAGE_KONVERT] += rd.st.time[ABC_STAGE_KONVERT];
+	    st.input_bytes += rd.st.input_bytes;
+	    if ((rd.err != 0) && (err == 0)) {
+		fprintf(stderr, "%s: read error %s (%s)\n", progname,
+			input_filename ? input_filename : "*stdin*",
+			strerror(rd.err));
+		err = 1;
+	    }
+	}
+	else {
+	    while(err == 0) {
+		t0 = abc_now();
+		len = fread(blkbuf+fill, sizeof(char), sizeof(blkbuf)-fill,
+			    fin);
+		st.time[ABC_STAGE_READ] += abc_now() - t0;
+		if (len == 0)
+		    break;
+		st.input_bytes += len;
+		if (konv) {
+		    t0 = abc_now();
+		    len = abc_konvert_chunk(blkbuf+fill, len, &cr);
+		    st.time[ABC_STAGE_KONVERT] += abc_now() - t0;
+		}
+		if ((fill += len) == sizeof(blkbuf)) {
+		    err = transmit_data_blocks(&tape, blkbuf, fill);
+		    filelen += fill;
+		    fill = 0;
+		}
+	    }
+	    if ((err == 0) && (fill > 0)) {
+		err = transmit_data_blocks(&tape, blkbuf, fill);
+		filelen += fill;
+	    }
+	}
+	if (verbose)
+	    fprintf(stderr, "input filelen = %ld\n", filelen);
+    }
+    if (pipeline) {
+	// the encoder only waited on the ring, the writer did the writes
+	ring_close(&wr.ring);
+	pthread_join(wr.tid, NULL);
+	ring_free(&wr.ring);
+	if (wr.err != 0) {
+	    errno = wr.err;
+	    err = -1;
+	}
+	st.time[ABC_STAGE_WRITE] = wr.st.time[ABC_STAGE_WRITE];
+	st.write_calls = wr.st.write_calls;
+	tape.sink = &wr.sink;
+	if (wr.pace != NULL)
+	    pace_report(&pace, wr.done, wall0, stderr);
+    }
+    if (streamed && (err == 0) && (tape.sink->seek != NULL) &&
+	(enc->audio_format != AUDIO_FORMAT_RAW)) {
+	if (verbose)
+	    fprintf(stderr, "%s: patch header Blk:%d Samp:%ld\n",
+		    progname, tape.nblocks,
+		    abc_num_samples(enc, tape.nblocks));
+	err = abc_patch_header(&tape);
+    }
+    if (err < 0)
+	fprintf(stderr, "%s: write error %s (%s)\n", progname,
+		output_filename ? output_filename : "*stdout*",
+		strerror(errno));
+    t0 = abc_now();
+    if (fout == stdout)
+	fflush(stdout);
+    else if ((fclose(fout) != 0) && (err == 0)) {
+	fprintf(stderr, "%s: write error %s (%s)\n", progname,
+		output_filename, strerror(errno));
+	err = -1;
+    }
+    st.time[ABC_STAGE_FLUSH] += abc_now() - t0;
+    if (fin != stdin)
+	fclose(fin);
+    if ((tape.verify != NULL) && (err == 0))
+	err = verify_report(&vf, output_filename, tape.nblocks);
+    if (check && (err == 0)) {
+	if (output_filename == NULL)
+	    fprintf(stderr, "%s: can not check *stdout*\n", progname);
+	else if (enc->audio_format == AUDIO_FORMAT_FLAC)
+	    fprintf(stderr, "%s: can not check flac output\n", progname);
+	else
+	    err = check_tape(enc, output_filename, tape.nblocks);
+    }
+    if (stats != NULL) {
+	st.wall = abc_now() - wall0;
+	st.files = 1;
+	abc_stats_add(stats, &st);
+    }
+    return err ? 1 : 0;
+}
+
+// Incremental encode (-I). The sidecar <output>.abcm has the settings
+// and header length of the last run and a line per block with the
+// phase before and after it and the sha-256 of the block. A block
+// with the same hash and phase as last time has the same samples, so
+// only the changed blocks are rendered where they are in the output.
+// A block that now starts in another phase changes every block after
+// it and they are all rendered again. Not with -e, where a block
+// reaches into the samples of the next, or flac, where the frames
+// have no fixed place.
+#define MANIFEST_SUFFIX ".abcm"
+#define MANIFEST_NAME   (FILENAME_MAX+8)   // room for <output>.abcm
+
+typedef struct {
+    uint8_t bx;           // phase before the block
+    uint8_t bx_end;       // phase after it
+    char    hash[2*SHA256_SIZE+1];
+} block_sum_t;
+
+// hash and phases of the numblk blocks of buf
+static void block_sums(abc_encoder_t* enc, abc_tape_t* tape,
+		       const char* buf, size_t len, int64_t numblk,
+		       block_sum_t* sum)
+{
+    uint8_t frame[MAX_FRAME_SIZE];
+    uint8_t digest[SHA256_SIZE];
+    union {
+	name_block_t nb;
+	data_block_t db;
+	uint8_t      b[256];
+    } blk;
+    sha256_t s;
+    size_t i, n, offs;
+    int64_t k;
+    int bx = tape->bx;
+
+    for (k = 0; k < numblk; k++) {
+	if (k == 0)
+	    abc_make_name_block(tape, &blk.nb);
+	else {
+	    offs = (k-1)*BLOCK_DATA_SIZE;
+	    n = (len - offs < BLOCK_DATA_SIZE) ? len - offs : BLOCK_DATA_SIZE;
+	    abc_make_data_block(k-1, buf + offs, n, &blk.db);
+	}
+	sha256_init(&s);
+	sha256_update(&s, blk.b, sizeof(blk.b));
+	sha256_final(&s, digest);
+	for (i = 0; i < SHA256_SIZE; i++)
+	    sprintf(sum[k].hash+2*i, "%02x", digest[i]);
+	n = abc_frame_block(blk.b, k ? enc->gap : enc->leader, frame);
+	sum[k].bx = bx;
+	for (i = 0; i < n; i++)
+	    bx = enc->byte_phase[(bx << 8) | frame[i]];
+	sum[k].bx_end = bx;
+    }
+}
+
+// first line of the manifest, the blocks must have the same place
+static void manifest_line(abc_encoder_t* enc, size_t hdrlen, char* buf,
+			  size_t size)
+{
+    snprintf(buf, size, "abcm f=%d z=%d b=%d r=%d L=%d,%d hdr=%lu\n",
+	     enc->audio_format, enc->bits_per_channel, enc->baud,
+	     enc->sample_rate, enc->leader, enc->gap, (unsigned long) hdrlen);
+}
+
+// the blocks of the last run, NULL if there is no manifest for these
+// settings
+static block_sum_t* read_manifest_sums(char* filename, char* head,
+				       int64_t* nblocks)
+{
+    char line[256];
+    block_sum_t* sum = NULL;
+    int64_t n = 0, size = 0;
+    int bx, bx_end;
+    FILE* f;
+
+    if ((f = fopen(filename, "r")) == NULL)
+	return NULL;
+    if ((fgets(line, sizeof(line), f) == NULL) || (strcmp(line, head) != 0)) {
+	fclose(f);
+	return NULL;
+    }
+    while(fgets(line, sizeof(line), f) != NULL) {
+	if (n == size) {
+	    size = size ? 2*size : 256;
+	    if ((sum = realloc(sum, size*sizeof(block_sum_t))) == NULL) {
+		fprintf(stderr, "%s: unable to allocate manifest (%s)\n",
+			progname, strerror(errno));
+		exit(1);
+	    }
+	}
+	if (sscanf(line, "%d %d %64s", &bx, &bx_end, sum[n].hash) != 3) {
+	    free(sum);
+	    fclose(f);
+	    return NULL;
+	}
+	sum[n].bx = bx;
+	sum[n].bx_end = bx_end;
+	n++;
+    }
+    fclose(f);
+    *nblocks = n;
+    return sum;
+}
+
+// written aside and renamed, a manifest is never half written
+static int write_manifest_sums(char* filename, char* head,
+			       block_sum_t* sum, int64_t nblocks)
+{
+    char tmpname[MANIFEST_NAME+8];
+    FILE* f;
+    int64_t k;
+
+    if (snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename) >=
+	(int) sizeof(tmpname)) {
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+    if ((f = fopen(tmpname, "w")) == NULL)
+	return -1;
+    fputs(head, f);
+    for (k = 0; k < nblocks; k++)
+	fprintf(f, "%d %d %s\n", sum[k].bx, sum[k].bx_end, sum[k].hash);
+    if ((fclose(f) != 0) || (rename(tmpname, filename) < 0)) {
+	unlink(tmpname);
+	return -1;
+    }
+    return 0;
+}
+
+int encode_incremental(abc_encoder_t* enc, char* input_filename,
+		       char* output_filename, int konv, abc_stats_t* stats)
+{
+    char manifest[MANIFEST_NAME];
+    char head[256];
+    block_sum_t* sum;
+    block_sum_t* old = NULL;
+    int64_t numblk, numsamp, oldblk = 0, k, first, rendered = 0;
+    abc_sink_t sink;
+    abc_tape_t tape;
+    abc_stats_t st;
+    struct stat sb;
+    FILE* fin = stdin;
+    FILE* fout = NULL;
+    char* buf;
+    void* map = NULL;
+    size_t map_len = 0, len, hdrlen, offs;
+    double wall0 = abc_now();
+    int err = 0;
 
-char name[8]="TESTTT  ";
-char ext[3]="BAC";
-int baud = DEFAULT_BAUD;   // baud
-int sample_rate = DEFAULT_SAMPLE_RATE;   // initial sample rate
-int hbitsz = (DEFAULT_SAMPLE_RATE/DEFAULT_BAUD)/2;
-int bitsz  = DEFAULT_SAMPLE_RATE/DEFAULT_BAUD;
-uint16_t frame_size = (DEFAULT_BITS_PER_CHANNEL*DEFAULT_NUM_CHANNELS+7)/8;
+    if (snprintf(manifest, sizeof(manifest), "%s%s", output_filename,
+		 MANIFEST_SUFFIX) >= (int) sizeof(manifest)) {
+	fprintf(stderr, "%s: file name too long %s\n",
+		progname, output_filename);
+	return 1;
+    }
+    if ((input_filename != NULL) &&
+	((fin = fopen(input_filename, "rb")) == NULL)) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, input_filename, strerror(errno));
+	return 1;
+    }
+    if ((buf = map_input(fin, &len, &map, &map_len)) == NULL)
+	buf = read_input(fin, &len);
+    if (fin != stdin)
+	fclose(fin);
+    memset(&st, 0, sizeof(st));
+    st.input_bytes = len;
 
-int verbose = 0;
+    abc_sink_memory(&sink, NULL, 0);  // header length
+    abc_tape_init(&tape, enc, &sink);
+    if (input_filename != NULL)
+	abc_tape_set_name(&tape, input_filename, &konv);
+    if (konv)
+	len = abc_konvert_line(buf, len);
+    numblk = abc_num_blocks(len);
+    numsamp = abc_num_samples(enc, numblk);
+    abc_write_header(&tape, numsamp);
+    hdrlen = sink.len;
+    abc_sink_free(&sink);
+    if ((sum = malloc(numblk*sizeof(block_sum_t))) == NULL) {
+	fprintf(stderr, "%s: unable to allocate manifest (%s)\n",
+		progname, strerror(errno));
+	exit(1);
+    }
+    block_sums(enc, &tape, buf, len, numblk, sum);
 
+    // the last run must be there as it was written
+    manifest_line(enc, hdrlen, head, sizeof(head));
+    if (((old = read_manifest_sums(manifest, head, &oldblk)) != NULL) &&
+	((stat(output_filename, &sb) < 0) ||
+	 (sb.st_size != hdrlen + abc_num_samples(enc, oldblk)*
+	  enc->frame_size) ||
+	 ((fout = fopen(output_filename, "r+b")) == NULL))) {
+	free(old);
+	old = NULL;
+    }
+
+    if (old == NULL) {
+	if (verbose)
+	    fprintf(stderr, "%s: no manifest for %s, full render\n",
+		    progname, output_filename);
+	oldblk = 0;
+	if ((fout = fopen(output_filename, "wb")) == NULL) {
+	    fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		    progname, output_filename, strerror(errno));
+	    exit(1);
+	}
+    }
+    // every block from the first one in another phase is rendered
+    for (first = 0; first < numblk; first++)
+	if ((first >= oldblk) || (sum[first].bx != old[first].bx))
+	    break;
+    abc_sink_file(&sink, fout);
+    tape.sink = &sink;
+    tape.hdrpos = 0;
+    if (stats != NULL)
+	tape.stats = &st;
+    err = abc_write_header(&tape, numsamp);
+    for (k = 0; (err == 0) && (k < numblk); k++) {
+	if ((k < first) && (strcmp(sum[k].hash, old[k].hash) == 0))
+	    continue;
+	offs = hdrlen + abc_num_samples(enc, k)*enc->frame_size;
+	if (sink.pos != offs) {
+	    if ((err = fseeko(fout, offs, SEEK_SET)) < 0)
+		break;
+	    sink.pos = offs;
+	}
+	tape.nblocks = k;
+	tape.bx = sum[k].bx;
+	tape.blcnt = k-1;
+	if (k == 0)
+	    err = abc_transmit_name_block(&tape);
+	else
+	    err = abc_transmit_data_block(&tape, buf + (k-1)*BLOCK_DATA_SIZE,
+					  len - (k-1)*BLOCK_DATA_SIZE);
+	rendered++;
+    }
+    if (fflush(fout) != 0)
+	err = -1;
+    if ((err == 0) &&
+	(ftruncate(fileno(fout), hdrlen + numsamp*enc->frame_size) < 0))
+	err = -1;
+    if ((fclose(fout) != 0) && (err == 0))
+	err = -1;
+    if (err < 0)
+	fprintf(stderr, "%s: write error %s (%s)\n", progname,
+		output_filename, strerror(errno));
+    if (map != NULL)
+	munmap(map, map_len);
+    else
+	free(buf);
+    // the blocks left as they were are read back too
+    if ((err == 0) && verify)
+	err = verify_file(enc, output_filename, hdrlen, numblk, &st);
+    if (stats != NULL) {
+	st.wall = abc_now() - wall0;
+	st.files = 1;
+	abc_stats_add(stats, &st);
+    }
+    if ((err == 0) && check)
+	err = check_tape(enc, output_filename, numblk);
+    if (verbose)
+	fprintf(stderr, "%s: rendered %ld of %ld blocks\n",
+		progname, rendered, numblk);
+    if ((err == 0) &&
+	(write_manifest_sums(manifest, head, sum, numblk) < 0)) {
+	fprintf(stderr, "%s: unable to write %s (%s)\n", progname,
+		manifest, strerror(errno));
+	err = 1;
+    }
+    if (err != 0)  // the output no longer matches a manifest
+	unlink(manifest);
+    free(old);
+    free(sum);
+    return err ? 1 : 0;
+}
 
-#define MAX_HBITSZ 128
-
-//
-// output sqaure wave samples
-// ABC 80  = 700 baud
-// ABC 800 = 700/2400 baud
-//
-//
-// |         |  = 0
-// |         | 
-// +----+----+
-//
-// +---------+
-// |         |  = 0
-// |         | 
-//
-// |    +----+  = 1
-// |    |    | 
-// +----+    +
-//
-// +----+    +  = 1
-// |    |    |
-// +    +----+
-//
-//
-typedef struct bstate {
-    int bx;
-    sample_t wl;
-    sample_t wh;
-} bstate_t;
-
-bstate_t bit_state = { .bx = 1 };
-
-uint8_t high_samples[MAX_HBITSZ*4];
-uint8_t low_samples[MAX_HBITSZ*4];
-
-void init_bits(bstate_t* bst, int bits_per_channel, sample_t wl, sample_t wh)
+// read and konvert every file into bufs and lens, return -1 if a
+// file can not be opened
+int read_files(abc_encoder_t* enc, int nfiles, char** files, int konv,
+	       char** bufs, size_t* lens, void** maps, size_t* map_lens,
+	       abc_stats_t* st)
 {
+    double t0;
     int i;
-    uint8_t* hptr;
-    uint8_t* lptr;
-    
-    bst->wl = wl;
-    bst->wh = wh;
 
-    lptr = low_samples;        
-    hptr = high_samples;
+    for (i = 0; i < nfiles; i++) {
+	abc_tape_t tape;
+	int k = konv;
+	FILE* fin;
 
-    switch(bits_per_channel) {
-    case 8:
-	memset(lptr, wl.u8, MAX_HBITSZ);
-	memset(hptr, wh.u8, MAX_HBITSZ);
-	break;
-    case 16:
-	for (i = 0; i < MAX_HBITSZ; i++) {
-	    memcpy(lptr, &wl.u16, sizeof(wl.u16));
-	    lptr += sizeof(wl.u16);
+	if ((fin = fopen(files[i], "rb")) == NULL) {
+	    fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		    progname, files[i], strerror(errno));
+	    return -1;
 	}
-	for (i = 0; i < MAX_HBITSZ; i++) {
-	    memcpy(hptr, &wh.u16, sizeof(wh.u16));
-	    hptr += sizeof(wh.u16);
+	abc_tape_init(&tape, enc, NULL);
+	abc_tape_set_name(&tape, files[i], &k);
+	t0 = abc_now();
+	bufs[i] = map_input(fin, &lens[i], &maps[i], &map_lens[i]);
+	if (bufs[i] == NULL)
+	    bufs[i] = read_input(fin, &lens[i]);
+	st->time[ABC_STAGE_READ] += abc_now() - t0;
+	st->input_bytes += lens[i];
+	fclose(fin);
+	if (k) {
+	    t0 = abc_now();
+	    lens[i] = abc_konvert_line(bufs[i], lens[i]);
+	    st->time[ABC_STAGE_KONVERT] += abc_now() - t0;
 	}
-	break;
-    case 24:
-	for (i = 0; i < MAX_HBITSZ; i++) {
-	    memcpy(lptr, &wl.u24, sizeof(wl.u24));
-	    lptr += sizeof(wl.u24);
+	if (verbose)
+	    fprintf(stderr, "%s: %s %ld bytes\n", progname, files[i], lens[i]);
+    }
+    return 0;
+}
+
+// Encode every input file into its own channel of one output (-C),
+// or one after the other with gap_ms of silence between them (-T)
+int encode_files(abc_encoder_t* enc, int nfiles, char** files,
+		 char* output_filename, int konv, int channels, int gap_ms,
+		 abc_stats_t* stats)
+{
+    FILE* fout = stdout;
+    abc_sink_t sink;
+    abc_stats_t st;
+    abc_program_t* prog = NULL;
+    char** bufs;
+    size_t* lens;
+    void** maps;          // mapped inputs
+    size_t* map_lens;
+    double t0, wall0 = abc_now();
+    int i, err = 0;
+
+    if ((nfiles < 1) || (channels && (nfiles > MAX_CHANNELS))) {
+	fprintf(stderr, "%s: -C needs 1 to %d input files, -T at least 1\n",
+		progname, MAX_CHANNELS);
+	return 1;
+    }
+    memset(&st, 0, sizeof(st));
+    bufs = calloc(nfiles, sizeof(char*));
+    lens = calloc(nfiles, sizeof(size_t));
+    maps = calloc(nfiles, sizeof(void*));
+    map_lens = calloc(nfiles, sizeof(size_t));
+    err = read_files(enc, nfiles, files, konv, bufs, lens, maps, map_lens,
+		     &st);
+    if ((err == 0) && (output_filename != NULL) &&
+	((fout = fopen(output_filename, "wb")) == NULL)) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, output_filename, strerror(errno));
+	err = -1;
+    }
+    if (err == 0) {
+	abc_sink_file(&sink, fout);
+	if (channels)
+	    err = abc_encode_channels(enc, &sink, nfiles, files, bufs, lens,
+				      &st);
+	else {
+	    prog = calloc(nfiles, sizeof(abc_program_t));
+	    for (i = 0; i < nfiles; i++) {
+		prog[i].filename = files[i];
+		prog[i].buf = bufs[i];
+		prog[i].len = lens[i];
+	    }
+	    err = abc_encode_image(enc, &sink, nfiles, prog,
+				   (int64_t) gap_ms*enc->sample_rate/1000,
+				   &st);
 	}
-	for (i = 0; i < MAX_HBITSZ; i++) {
-	    memcpy(hptr, &wh.u24, sizeof(wh.u24));
-	    hptr += sizeof(wh.u24);
+	if (err < 0)
+	    fprintf(stderr, "%s: write error %s (%s)\n", progname,
+		    output_filename ? output_filename : "*stdout*",
+		    strerror(errno));
+	t0 = abc_now();
+	if (fout == stdout)
+	    fflush(stdout);
+	else if ((fclose(fout) != 0) && (err == 0)) {
+	    fprintf(stderr, "%s: write error %s (%s)\n", progname,
+		    output_filename, strerror(errno));
+	    err = -1;
 	}
-	break;	
-    case 32:
-	for (i = 0; i < MAX_HBITSZ; i++) {
-	    memcpy(lptr, &wl.u32, sizeof(wl.u32));
-	    lptr += sizeof(wl.u32);
+	st.time[ABC_STAGE_FLUSH] += abc_now() - t0;
+    }
+    // wav has the index as cue points, au and raw get <output>.idx
+    if ((err == 0) && (prog != NULL) &&
+	(enc->audio_format != AUDIO_FORMAT_WAV) && (output_filename != NULL)) {
+	char idxname[FILENAME_MAX+5];
+	FILE* f;
+
+	snprintf(idxname, sizeof(idxname), "%s.idx", output_filename);
+	if ((f = fopen(idxname, "w")) == NULL) {
+	    fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		    progname, idxname, strerror(errno));
+	    err = -1;
 	}
-	for (i = 0; i < MAX_HBITSZ; i++) {
-	    memcpy(hptr, &wh.u32, sizeof(wh.u32));
-	    hptr += sizeof(wh.u32);
+	else {
+	    abc_image_index(enc, prog, nfiles, f);
+	    fclose(f);
 	}
-	break;
-    default:
-	break;
     }
+    for (i = 0; i < nfiles; i++) {
+	if (maps[i] != NULL)
+	    munmap(maps[i], map_lens[i]);
+	else
+	    free(bufs[i]);
+    }
+    free(bufs);
+    free(lens);
+    free(maps);
+    free(map_lens);
+    free(prog);
+    if (stats != NULL) {
+	st.wall = abc_now() - wall0;
+	st.files = nfiles;
+	abc_stats_add(stats, &st);
+    }
+    return err ? 1 : 0;
+}
+
+// JSON run statistics to filename, "-" is stderr
+void write_stats(char* filename, abc_stats_t* stats)
+{
+    FILE* f = stderr;
+
+    if ((strcmp(filename, "-") != 0) && ((f = fopen(filename, "w")) == NULL)) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, filename, strerror(errno));
+	return;
+    }
+    abc_stats_report(stats, f);
+    if (f != stderr)
+	fclose(f);
 }
 
-void transmit_bit(bstate_t* bst, int bit, FILE *fout)
+typedef struct {
+    char* input_filename;
+    char* output_filename;
+} batch_file_t;
+
+typedef struct {
+    batch_file_t* files;
+    int nfiles;
+    int next;            // next file to encode
+    int failed;          // number of failed files
+    abc_encoder_t* enc;  // shared by all files
+    int konv;
+    int memory_output;
+    abc_stats_t* stats;  // NULL or summed over all files
+    pthread_mutex_t lock;
+} batch_t;
+
+void add_batch_file(batch_t* batch, char* input_filename,
+		    char* output_filename)
 {
-    bst->bx = !bst->bx;
-    fwrite(bst->bx ? high_samples : low_samples, frame_size, hbitsz, fout);
-    
-    if (bit) // send "1"
-	bst->bx = !bst->bx;
-    fwrite(bst->bx ? high_samples : low_samples, frame_size, hbitsz, fout);
+    batch_file_t* files;
+
+    if ((batch->nfiles & 255) == 0) {
+	files = realloc(batch->files, (batch->nfiles+256)*sizeof(batch_file_t));
+	if (files == NULL) {
+	    fprintf(stderr, "%s: unable to allocate batch (%s)\n",
+		    progname, strerror(errno));
+	    exit(1);
+	}
+	batch->files = files;
+    }
+    batch->files[batch->nfiles].input_filename = input_filename;
+    batch->files[batch->nfiles].output_filename = output_filename;
+    batch->nfiles++;
 }
 
-void transmit_byte(uint8_t b, FILE *fout)
+// output is <input>.<wav|au|raw|flac> placed in dir or next to the input
+char* batch_output_name(char* input_filename, char* dir, int audio_format)
 {
-    bstate_t* bst = &bit_state;
-    int i, mask = 0x01;
+    char* suffix;
+    char* base;
+    char* name;
 
-    for (i=0; i<8; i++) {
-	transmit_bit(bst, mask & b, fout);
-	mask <<= 1; // next bit
+    switch(audio_format) {
+    case AUDIO_FORMAT_WAV: suffix = ".wav"; break;
+    case AUDIO_FORMAT_AU:  suffix = ".au"; break;
+    case AUDIO_FORMAT_FLAC: suffix = ".flac"; break;
+    default: suffix = ".raw"; break;
+    }
+    if (dir == NULL) {
+	dir = "";
+	base = input_filename;
+    }
+    else if ((base = strrchr(input_filename, '/')) == NULL)
+	base = input_filename;
+    else
+	base++;
+    if ((name = malloc(strlen(dir)+1+strlen(base)+strlen(suffix)+1)) == NULL) {
+	fprintf(stderr, "%s: unable to allocate filename (%s)\n",
+		progname, strerror(errno));
+	exit(1);
     }
+    sprintf(name, "%s%s%s%s", dir, (*dir && (dir[strlen(dir)-1] != '/')) ?
+	    "/" : "", base, suffix);
+    return name;
 }
 
-void transmit_uint16_le(uint16_t w, FILE* fout)
+// manifest lines are "<input> [<output>]", empty lines and # comments
+// are skipped
+void read_manifest(batch_t* batch, char* manifest, char* dir)
 {
-    transmit_byte(w, fout);
-    transmit_byte(w >> 8, fout);
+    char line[2*FILENAME_MAX+2];
+    FILE* f;
+
+    if ((f = fopen(manifest, "r")) == NULL) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, manifest, strerror(errno));
+	exit(1);
+    }
+    while(fgets(line, sizeof(line), f) != NULL) {
+	char* input_filename = strtok(line, " \t\r\n");
+	char* output_filename = strtok(NULL, " \t\r\n");
+
+	if ((input_filename == NULL) || (*input_filename == '#'))
+	    continue;
+	input_filename = strdup(input_filename);
+	if (output_filename != NULL)
+	    output_filename = strdup(output_filename);
+	else
+	    output_filename = batch_output_name(input_filename, dir,
+						batch->enc->audio_format);
+	add_batch_file(batch, input_filename, output_filename);
+    }
+    fclose(f);
 }
 
-uint16_t checksum16(uint8_t* ptr, size_t len)
+void* batch_worker(void* arg)
 {
-    uint16_t csum = 0;
-    while(len--)
-	csum += *ptr++;
-    return csum;
+    batch_t* batch = (batch_t*) arg;
+    int i;
+
+    while((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+	  batch->nfiles) {
+	batch_file_t* file = &batch->files[i];
+	abc_stats_t st;
+
+	memset(&st, 0, sizeof(st));
+	if (encode_file(batch->enc, file->input_filename,
+			file->output_filename, batch->konv,
+			batch->memory_output, 1,
+			batch->stats ? &st : NULL) != 0)
+	    __atomic_fetch_add(&batch->failed, 1, __ATOMIC_RELAXED);
+	if (batch->stats != NULL) {
+	    pthread_mutex_lock(&batch->lock);
+	    abc_stats_add(batch->stats, &st);
+	    pthread_mutex_unlock(&batch->lock);
+	}
+    }
+    return NULL;
 }
 
-// write 32 + 3 + 1 + 256 + 1 + 2
-//       0  sync stx  data etx checksum
-//          
-void transmit_block(uint8_t* buf, FILE *fout)
+// encode all files on jobs threads, the sample tables are shared
+int encode_batch(batch_t* batch, int jobs)
 {
+    pthread_t* tid;
     int i;
-    uint16_t csum;
-    
-    for (i=0; i<32; i++) transmit_byte(0,fout);           // 32 0 bytes
-    for (i=0; i<3; i++)  transmit_byte(SYNC,fout);        // 3 sync bytes 16H
-    transmit_byte(STX, fout);
-    // output the block
-    for (i=0; i<256; i++)
-	transmit_byte(buf[i], fout);
-    transmit_byte(ETX,fout);
-    
-    // calculate the checksum
-    csum = checksum16(buf, 256);
-    // csum includes ETX char!!! (as correctly stated in Mikrodatorns ABC)
-    csum += ETX;
 
-    transmit_uint16_le(csum, fout);
+    if (jobs > batch->nfiles)
+	jobs = batch->nfiles;
+    if (jobs < 1)
+	jobs = 1;
+    if ((tid = malloc(jobs*sizeof(pthread_t))) == NULL) {
+	fprintf(stderr, "%s: unable to allocate threads (%s)\n",
+		progname, strerror(errno));
+	exit(1);
+    }
+    batch->next = 0;
+    batch->failed = 0;
+    for (i = 0; i < jobs; i++) {
+	if (pthread_create(&tid[i], NULL, batch_worker, batch) != 0) {
+	    fprintf(stderr, "%s: unable to create thread (%s)\n",
+		    progname, strerror(errno));
+	    exit(1);
+	}
+    }
+    for (i = 0; i < jobs; i++)
+	pthread_join(tid[i], NULL);
+    free(tid);
+    if (verbose || batch->failed)
+	fprintf(stderr, "%s: encoded %d files, %d failed\n",
+		progname, batch->nfiles - batch->failed, batch->failed);
+    return batch->failed ? 1 : 0;
 }
 
-// 3 + 8 + 3
-// <<0xff,0xff,0xff,F,I,L,E,N,A,M,E,'B','A','C', 0:
+// Encode daemon (-D <socket>) and its client (-U <socket>). A job is
+// one connection, the client sends the request line
+//   encode name=<file> len=<n> b=<baud> r=<rate> f=<format> z=<bits>
+//          k=<0|1> e=<0|1>
+// and n bytes of input, the daemon answers "ok hit|miss <key>" and
+// the audio as it is rendered in chunks of a "<len>\n" line and len
+// bytes, up to a "0\n" line. "error <message>" is sent instead of the
+// answer or of the next chunk. The encoders are kept initialized
+// between jobs. With -o <dir> the audio is cached as
+// <dir>/<xx>/<key>.<format>, the key is the sha-256 of the request
+// line (with the konv in effect) and the input, and a cached job is
+// sent from the file.
+#define DAEMON_ENCODERS  32
+#define DAEMON_JOBS      8          // jobs running at once
+#define DAEMON_LINE      512
+#define DAEMON_CHUNK     (64*1024)  // client reads
+#define DAEMON_MAX_INPUT (65535L*BLOCK_DATA_SIZE)  // 16 bit block counter
+
+typedef struct {
+    char   name[256];     // input file name, "-" = none
+    size_t len;
+    int    baud;
+    int    rate;
+    int    format;
+    int    bits;
+    int    konv;
+    int    exact;
+} job_t;
+
+static const char* format_name[] = { "raw", "wav", "au", "flac" };
 
-void transmit_name_block(FILE *fout)
+typedef struct {
+    abc_encoder_t enc;
+    int format, bits, baud, rate, exact;
+} warm_encoder_t;
+
+static char* daemon_socket;
+static char* cache_dir;
+static warm_encoder_t* warm[DAEMON_ENCODERS];
+static int nwarm = 0;
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int njobs = 0;
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_done = PTHREAD_COND_INITIALIZER;
+
+static int read_full(int fd, void* ptr, size_t len)
 {
-    name_block_t block;
+    uint8_t* p = ptr;
+    ssize_t n;
 
-    memset(block.header, 0xff, sizeof(block.header));
-    memcpy(block.name,   name, sizeof(name));
-    memcpy(block.ext,    ext,  sizeof(ext));
-    memset(block.pad,    0,    sizeof(block.pad));
-    transmit_block((uint8_t*) &block, fout);
+    while(len > 0) {
+	if ((n = read(fd, p, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (n == 0) {
+	    errno = EPIPE;
+	    return -1;
+	}
+	p += n;
+	len -= n;
+    }
+    return 0;
 }
 
-void transmit_data_block(int cnt, char* buf, size_t len, FILE *fout)
+static int write_full(int fd, const void* ptr, size_t len)
 {
-    data_block_t block;
+    const uint8_t* p = ptr;
+    ssize_t n;
 
-    block.pad = 0;
-    block.blcnt = cnt;
-    if (len >= sizeof(block.data)) {
-	memcpy(&block.data, buf, sizeof(block.data));
+    while(len > 0) {
+	if ((n = write(fd, p, len)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	p += n;
+	len -= n;
     }
-    else {
-	memcpy(&block.data, buf, len);
-	memset(&block.data+len, 0, sizeof(block.data)-len);
+    return 0;
+}
+
+// one \n terminated line without the \n, a byte at a time so nothing
+// after it is read
+static int read_line(int fd, char* buf, size_t size)
+{
+    size_t i = 0;
+
+    while(i < size-1) {
+	if (read_full(fd, buf+i, 1) < 0)
+	    return -1;
+	if (buf[i] == '\n') {
+	    buf[i] = '\0';
+	    return i;
+	}
+	i++;
     }
-    little16(&block.blcnt);
-    transmit_block((uint8_t*) &block, fout);
-    if (verbose)
-	fprintf(stderr, "%s: output block len=%ld #%d\n", progname, len, cnt);
+    errno = EINVAL;
+    return -1;
 }
 
-void transmit_data_blocks(char* buf, size_t len, FILE *fout)
+static size_t job_line(job_t* job, char* buf, size_t size)
 {
-    int cnt = 0;    
-    while (len > 0) {
-	transmit_data_block(cnt++, buf, len, fout);
-	len = (len >= 253) ? len-253 : 0;
+    return snprintf(buf, size, "encode name=%s len=%lu b=%d r=%d f=%s z=%d "
+		    "k=%d e=%d\n", job->name, (unsigned long) job->len,
+		    job->baud, job->rate, format_name[job->format],
+		    job->bits, job->konv, job->exact);
+}
+
+static int parse_job(char* line, job_t* job)
+{
+    char* save;
+    char* tok;
+    char* val;
+    int i;
+
+    memset(job, 0, sizeof(job_t));
+    strcpy(job->name, "-");
+    job->baud = DEFAULT_BAUD;
+    job->rate = DEFAULT_SAMPLE_RATE;
+    job->format = DEFAULT_AUDIO_FORMAT;
+    job->bits = DEFAULT_BITS_PER_CHANNEL;
+    if (strncmp(line, "encode ", 7) != 0)
+	return -1;
+    for (tok = strtok_r(line+7, " ", &save); tok != NULL;
+	 tok = strtok_r(NULL, " ", &save)) {
+	if ((val = strchr(tok, '=')) == NULL)
+	    return -1;
+	*val++ = '\0';
+	if (strcmp(tok, "name") == 0) {
+	    if ((*val == '\0') || (strlen(val) >= sizeof(job->name)))
+		return -1;
+	    strcpy(job->name, val);
+	}
+	else if (strcmp(tok, "len") == 0)
+	    job->len = strtoul(val, NULL, 10);
+	else if (strcmp(tok, "b") == 0)
+	    job->baud = atoi(val);
+	else if (strcmp(tok, "r") == 0)
+	    job->rate = atoi(val);
+	else if (strcmp(tok, "f") == 0) {
+	    for (i = 0; i < 4; i++)
+		if (strcmp(val, format_name[i]) == 0)
+		    break;
+	    job->format = i;
+	}
+	else if (strcmp(tok, "z") == 0)
+	    job->bits = atoi(val);
+	else if (strcmp(tok, "k") == 0)
+	    job->konv = (atoi(val) != 0);
+	else if (strcmp(tok, "e") == 0)
+	    job->exact = (atoi(val) != 0);
+	else
+	    return -1;
     }
+    if (((job->baud != 700) && (job->baud != 2400)) || (job->rate < 1400) ||
+	((job->bits != 8) && (job->bits != 16) && (job->bits != 24) &&
+	 (job->bits != 32)) || (job->format > AUDIO_FORMAT_FLAC) ||
+	(job->len > DAEMON_MAX_INPUT) ||
+	((job->format == AUDIO_FORMAT_FLAC) && job->exact))
+	return -1;
+    return 0;
 }
 
-void write_wav(FILE *f, int numsamp, int bits_per_channel, int num_channels)
+// hex sha-256 of the request line and the input
+static void job_key(job_t* job, const char* buf, char* key)
 {
-    int srate;
-    uint32_t totlen;
-    uint16_t fsize = (bits_per_channel*num_channels+7)/8;
-    wav_header_t wav;
+    char line[DAEMON_LINE];
+    uint8_t digest[SHA256_SIZE];
+    sha256_t s;
+    int i;
 
-    if (numsamp < 0)
-	totlen = 0xffffffff;
-    else
-	totlen = (5*4 + 24)+numsamp*fsize;
+    sha256_init(&s);
+    sha256_update(&s, line, job_line(job, line, sizeof(line)));
+    sha256_update(&s, buf, job->len);
+    sha256_final(&s, digest);
+    for (i = 0; i < SHA256_SIZE; i++)
+	sprintf(key+2*i, "%02x", digest[i]);
+}
+
+// an initialized encoder for the job, *tmp is set when it is not kept
+static abc_encoder_t* job_encoder(job_t* job, int* tmp)
+{
+    warm_encoder_t* w = NULL;
+    int i, r;
 
-    write_tag(f, WAV_ID_RIFF);
-    write_32le(f, totlen);
-    
-    write_tag(f, WAV_ID_WAVE);
-    write_tag(f, WAV_ID_FMT);
-    write_32le(f, sizeof(wav_header_t));
+    pthread_mutex_lock(&warm_lock);
+    for (i = 0; i < nwarm; i++) {
+	w = warm[i];
+	if ((w->format == job->format) && (w->bits == job->bits) &&
+	    (w->baud == job->baud) && (w->rate == job->rate) &&
+	    (w->exact == job->exact)) {
+	    pthread_mutex_unlock(&warm_lock);
+	    *tmp = 0;
+	    return &w->enc;
+	}
+    }
+    if ((w = malloc(sizeof(warm_encoder_t))) != NULL) {
+	if (job->exact)
+	    r = abc_encoder_init_exact(&w->enc, job->format, job->bits,
+				       job->baud, job->rate);
+	else
+	    r = abc_encoder_init(&w->enc, job->format, job->bits,
+				 job->baud, job->rate);
+	if (r < 0) {
+	    free(w);
+	    w = NULL;
+	}
+    }
+    if (w != NULL) {
+	w->format = job->format;
+	w->bits = job->bits;
+	w->baud = job->baud;
+	w->rate = job->rate;
+	w->exact = job->exact;
+	if ((*tmp = (nwarm == DAEMON_ENCODERS)) == 0)
+	    warm[nwarm++] = w;
+    }
+    pthread_mutex_unlock(&warm_lock);
+    return w ? &w->enc : NULL;
+}
 
-    wav.AudioFormat = WAVE_FORMAT_PCM;   // PCM
-    wav.NumChannels = num_channels;      // Mono=1 | Stereo=2
-    wav.SampleRate  = sample_rate; // Sample Rate (Binary, in Hz)
-    wav.ByteRate    = sample_rate; // Byte Rate = sample rates since mono 8-bit
-    wav.FrameSize   = fsize;
-    wav.BitsPerChannel = bits_per_channel;
-    write_wav_header(f, &wav);
+// the audio of a job goes to the client and to a temporary cache
+// file, which is renamed in place when the job is done so a reader
+// sees all of it or nothing
+typedef struct {
+    int  fd;              // client
+    int  cfd;             // cache file, -1 = none or failed
+    char tmp[FILENAME_MAX+1];
+} job_out_t;
 
-    // "data" + length:32 + data...
-    write_tag(f, WAV_ID_DATA);
-    write_32le(f, numsamp*fsize);
+static void cache_open(job_out_t* out, const char* key)
+{
+    out->cfd = -1;
+    if (cache_dir == NULL)
+	return;
+    snprintf(out->tmp, sizeof(out->tmp), "%s/%.2s", cache_dir, key);
+    if ((mkdir(out->tmp, 0777) < 0) && (errno != EEXIST))
+	return;
+    snprintf(out->tmp, sizeof(out->tmp), "%s/%.2s/.%s.XXXXXX",
+	     cache_dir, key, key);
+    out->cfd = mkstemp(out->tmp);
 }
 
-void write_au(FILE *f, int numsamp, int bits_per_channel, int num_channels)
+// keep the cache file as path if the job went through, else drop it
+static void cache_close(job_out_t* out, const char* path, int ok)
 {
-    int srate;
-    uint32_t numbytes;
-    uint16_t fsize = (bits_per_channel*num_channels+7)/8;    
-    au_header_t au;
+    if (out->cfd < 0)
+	return;
+    if ((close(out->cfd) < 0) || !ok || (rename(out->tmp, path) < 0))
+	unlink(out->tmp);
+    out->cfd = -1;
+}
 
-    if (numsamp == -1)
-	numbytes = 0xffffffff;  // unknown
-    else
-	numbytes = numsamp*fsize;
+// callback sink, one chunk to the client and the same to the cache
+static int job_write(void* arg, const void* ptr, size_t len)
+{
+    job_out_t* out = (job_out_t*) arg;
+    char line[32];
 
-    au.magic = AU_MAGIC;
-    au.data_offset = 28;   // minimum
-    au.data_size   = numbytes;
-    switch(bits_per_channel) {
-    case 8:  au.encoding = AU_ENCODING_LINEAR_8; break;
-    case 16: au.encoding = AU_ENCODING_LINEAR_16; break;
-    case 24: au.encoding = AU_ENCODING_LINEAR_24; break;
-    case 32: au.encoding = AU_ENCODING_LINEAR_32; break;
+    if ((write_full(out->fd, line, snprintf(line, sizeof(line), "%lu\n",
+					    (unsigned long) len)) < 0) ||
+	(write_full(out->fd, ptr, len) < 0))
+	return -1;
+    if ((out->cfd >= 0) && (write_full(out->cfd, ptr, len) < 0)) {
+	close(out->cfd);  // the job goes on without the cache
+	unlink(out->tmp);
+	out->cfd = -1;
     }
-    au.sample_rate = sample_rate;
-    au.channels    = num_channels;
-    strcpy(au.annot, "ABC");
-    
-    write_au_header(f, &au);
+    return 0;
 }
 
-void usage()
+static void job_reply_error(int fd, const char* msg)
 {
-    fprintf(stderr, "usage: %s [<options>] [<file>[.bas|.bac|other]]\n",
-	    progname);
-    fprintf(stderr, "OPTIONS\n");
-    fprintf(stderr, "    -h               help\n");
-    fprintf(stderr, "    -v               verbose\n");    
-    fprintf(stderr, "    -k               konvert \\n to \\r\n");
-    fprintf(stderr, "    -b (700)|2400    baud rate\n");
-    fprintf(stderr, "    -r >1400         audio sample rate\n");
-    fprintf(stderr, "    -f (wav)|au|raw  audio format\n");
-    fprintf(stderr, "    -z (8)|16|32     audio bits per channel\n");    
-    fprintf(stderr, "    -o <filename>    audio output filename\n");
-    exit(1);
+    char line[DAEMON_LINE];
+
+    write_full(fd, line, snprintf(line, sizeof(line), "error %s\n", msg));
+}
+
+static void* daemon_job(void* arg)
+{
+    int fd = (int) (intptr_t) arg;
+    char line[DAEMON_LINE];
+    char key[2*SHA256_SIZE+1];
+    char path[FILENAME_MAX+1];
+    char* buf = NULL;
+    abc_encoder_t* enc;
+    abc_sink_t sink;
+    job_out_t out;
+    struct stat st;
+    void* map;
+    job_t job;
+    size_t len, n;
+    double t0 = abc_now();
+    int cfd, tmp;
+    int hit = 0;
+    int err = -1;
+
+    if ((read_line(fd, line, sizeof(line)) < 0) ||
+	(parse_job(line, &job) < 0)) {
+	job_reply_error(fd, "bad request");
+	goto done;
+    }
+    if ((buf = malloc(job.len+1)) == NULL) {
+	job_reply_error(fd, strerror(errno));
+	goto done;
+    }
+    if (read_full(fd, buf, job.len) < 0) {
+	job_reply_error(fd, "short input");
+	goto done;
+    }
+    // konv as for a local file, from -k or the file name, the key is
+    // the same for both ways of asking for it
+    job.konv = job.konv ||
+	((strcmp(job.name, "-") != 0) && abc_konv_name(job.name));
+    job_key(&job, buf, key);
+    if (cache_dir != NULL) {
+	snprintf(path, sizeof(path), "%s/%.2s/%s.%s", cache_dir, key, key,
+		 format_name[job.format]);
+	if ((cfd = open(path, O_RDONLY)) >= 0) {
+	    if ((fstat(cfd, &st) == 0) && (st.st_size > 0) &&
+		((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			     cfd, 0)) != MAP_FAILED)) {
+		hit = 1;
+		n = snprintf(line, sizeof(line), "ok hit %s\n%ld\n",
+			     key, (long) st.st_size);
+		if ((write_full(fd, line, n) == 0) &&
+		    (write_full(fd, map, st.st_size) == 0))
+		    write_full(fd, "0\n", 2);
+		munmap(map, st.st_size);
+	    }
+	    close(cfd);
+	    if (hit)
+		goto done;
+	}
+    }
+    if ((enc = job_encoder(&job, &tmp)) == NULL) {
+	job_reply_error(fd, strerror(errno));
+	goto done;
+    }
+    len = job.len;
+    if (job.konv)
+	len = abc_konvert_line(buf, len);
+    // the audio is sent while it is rendered, nothing is kept
+    n = snprintf(line, sizeof(line), "ok miss %s\n", key);
+    if ((err = write_full(fd, line, n)) == 0) {
+	out.fd = fd;
+	cache_open(&out, key);
+	abc_sink_callback(&sink, job_write, &out);
+	if ((err = abc_encode(enc, &sink,
+			      strcmp(job.name, "-") ? job.name : NULL,
+			      buf, len)) < 0)
+	    job_reply_error(fd, strerror(errno));
+	else
+	    err = write_full(fd, "0\n", 2);
+	cache_close(&out, path, err == 0);
+    }
+    if (tmp) {
+	abc_encoder_free(enc);
+	free(enc);
+    }
+done:
+    if (verbose)
+	fprintf(stderr, "%s: job %s %lu bytes %s %.1f ms\n", progname,
+		job.name, (unsigned long) job.len,
+		hit ? "hit" : (err == 0) ? "encoded" : "error",
+		(abc_now() - t0)*1000);
+    free(buf);
+    close(fd);
+    pthread_mutex_lock(&jobs_lock);
+    njobs--;
+    pthread_cond_signal(&jobs_done);
+    pthread_mutex_unlock(&jobs_lock);
+    return NULL;
+}
+
+static void daemon_stop(int sig)
+{
+    unlink(daemon_socket);
+    _exit(0);
 }
 
-// replace \n with \r and remove multiple \r\r.. with one \r
-size_t konvert_line(char* ptr, size_t len)
+// accept jobs on the socket until killed, each on a thread of its
+// own, at most DAEMON_JOBS at a time, the rest wait in the backlog
+int run_daemon(char* socket_path, char* dir)
 {
-    int c, oldc = 0;
-    char* ptr0 = ptr;
-    char* fptr;
-    
-    fptr = ptr;
-    while(len--) {
-	c = *ptr++;
-	if (c == '\n')
-	    c = '\r';
-	if (c == '\r') {
-	    if (oldc != '\r')
-		*fptr++ = c;
+    struct sockaddr_un addr;
+    pthread_attr_t attr;
+    pthread_t tid;
+    struct stat st;
+    int lfd, fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+	fprintf(stderr, "%s: socket path too long %s\n",
+		progname, socket_path);
+	return 1;
+    }
+    if ((dir != NULL) && (mkdir(dir, 0777) < 0) && (errno != EEXIST)) {
+	fprintf(stderr, "%s: unable to create cache %s (%s)\n",
+		progname, dir, strerror(errno));
+	return 1;
+    }
+    cache_dir = dir;
+    daemon_socket = socket_path;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    // a socket left by an earlier daemon is removed, nothing else
+    if ((stat(socket_path, &st) == 0) && S_ISSOCK(st.st_mode))
+	unlink(socket_path);
+    if (((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+	(bind(lfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) ||
+	(listen(lfd, 64) < 0)) {
+	fprintf(stderr, "%s: unable to listen on %s (%s)\n",
+		progname, socket_path, strerror(errno));
+	return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, daemon_stop);
+    signal(SIGTERM, daemon_stop);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (verbose)
+	fprintf(stderr, "%s: listening on %s, cache %s\n", progname,
+		socket_path, dir ? dir : "off");
+    for (;;) {
+	pthread_mutex_lock(&jobs_lock);
+	while(njobs >= DAEMON_JOBS)
+	    pthread_cond_wait(&jobs_done, &jobs_lock);
+	pthread_mutex_unlock(&jobs_lock);
+	if ((fd = accept(lfd, NULL, NULL)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf(stderr, "%s: accept failed (%s)\n",
+		    progname, strerror(errno));
+	    return 1;
 	}
-	else { // c != '\r'
-	    *fptr++ = c;
+	pthread_mutex_lock(&jobs_lock);
+	njobs++;
+	pthread_mutex_unlock(&jobs_lock);
+	if (pthread_create(&tid, &attr, daemon_job, (void*) (intptr_t) fd)
+	    != 0) {
+	    close(fd);
+	    pthread_mutex_lock(&jobs_lock);
+	    njobs--;
+	    pthread_mutex_unlock(&jobs_lock);
 	}
-	oldc = c;
     }
-    return fptr-ptr0;
 }
 
+// send one job to the daemon and write the audio it returns
+int encode_remote(char* socket_path, char* input_filename,
+		  char* output_filename, job_t* job)
+{
+    struct sockaddr_un addr;
+    char line[DAEMON_LINE];
+    char chunk[DAEMON_CHUNK];
+    char* base;
+    char* buf = NULL;
+    FILE* fin = stdin;
+    FILE* fout = stdout;
+    size_t len, n;
+    int fd = -1;
+    int err = 1;
+
+    if (input_filename != NULL) {
+	if ((fin = fopen(input_filename, "rb")) == NULL) {
+	    fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		    progname, input_filename, strerror(errno));
+	    return 1;
+	}
+	base = (base = strrchr(input_filename, '/')) ? base+1 : input_filename;
+	if ((strlen(base) >= sizeof(job->name)) || strpbrk(base, " \t\n")) {
+	    fprintf(stderr, "%s: can not send file name %s\n",
+		    progname, base);
+	    fclose(fin);
+	    return 1;
+	}
+	strcpy(job->name, base);
+    }
+    buf = read_input(fin, &len);
+    if (fin != stdin)
+	fclose(fin);
+    job->len = len;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+    if (((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+	(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0)) {
+	fprintf(stderr, "%s: unable to connect to %s (%s)\n",
+		progname, socket_path, strerror(errno));
+	goto done;
+    }
+    if ((write_full(fd, line, job_line(job, line, sizeof(line))) < 0) ||
+	(write_full(fd, buf, len) < 0) ||
+	(read_line(fd, line, sizeof(line)) < 0)) {
+	fprintf(stderr, "%s: %s: %s\n", progname, socket_path,
+		strerror(errno));
+	goto done;
+    }
+    if (strncmp(line, "ok ", 3) != 0) {
+	fprintf(stderr, "%s: %s: %s\n", progname, socket_path, line);
+	goto done;
+    }
+    if (verbose)
+	fprintf(stderr, "%s: %s\n", progname, line);
+    if ((output_filename != NULL) &&
+	((fout = fopen(output_filename, "wb")) == NULL)) {
+	fprintf(stderr, "%s: unable to open file %s (%s)\n",
+		progname, output_filename, strerror(errno));
+	goto done;
+    }
+    // chunks up to "0", an error line ends the job early
+    for (;;) {
+	if (read_line(fd, line, sizeof(line)) < 0) {
+	    fprintf(stderr, "%s: transfer failed (%s)\n",
+		    progname, strerror(errno));
+	    goto done;
+	}
+	if (strncmp(line, "error ", 6) == 0) {
+	    fprintf(stderr, "%s: %s: %s\n", progname, socket_path, line);
+	    goto done;
+	}
+	if ((len = strtoul(line, NULL, 10)) == 0)
+	    break;
+	while(len > 0) {
+	    n = (len < sizeof(chunk)) ? len : sizeof(chunk);
+	    if ((read_full(fd, chunk, n) < 0) ||
+		(fwrite(chunk, sizeof(char), n, fout) != n)) {
+		fprintf(stderr, "%s: transfer failed (%s)\n",
+			progname, strerror(errno));
+		goto done;
+	    }
+	    len -= n;
+	}
+    }
+    err = 0;
+done:
+    if (fd >= 0)
+	close(fd);
+    free(buf);
+    if ((fout != stdout) ? (fclose(fout) != 0) : (fflush(fout) != 0)) {
+	if (err == 0)
+	    fprintf(stderr, "%s: write error %s (%s)\n", progname,
+		    output_filename ? output_filename : "*stdout*",
+		    strerror(errno));
+	err = 1;
+    }
+    return err;
+}
 
 int main(char argc, char *argv[])
 {
-    int filelen=-1;
-    int numblk,numsamp,numbyte;
-    // struct stat filestat;
     FILE* fin = stdin;
-    FILE* fout = stdout;
     char* ptr;
-    char* fptr;
-    int i;
     int konv = 0;
+    int memory_output = 0;
+    int exact = 0;
+    char* stats_filename = NULL;
+    abc_stats_t stats;
+    double wall0 = abc_now();
+    int r;
+    int jobs = 1;
+    int decode = 0;
+    int batch_mode = 0;
+    int channels = 0;
+    int image = 0;
+    int gap_ms = 0;
+    char* manifest = NULL;
+    batch_t batch;
+    int baud_given = 0;
     int opt;
     int rate0 = DEFAULT_SAMPLE_RATE;
-    int br;
+    int leader = 0;
+    int gap = 0;
+    abc_encoder_t enc;
     int audio_format = AUDIO_FORMAT_UNDEF;
     int bits_per_channel = DEFAULT_BITS_PER_CHANNEL;
     char* input_filename = "*stdin*";
     char* output_filename = NULL;
-    sample_t wl, wh;
+    char* daemon_path = NULL;
+    char* remote_path = NULL;
+    int incremental = 0;
+    static struct option long_options[] = {
+	{ "verify", no_argument, &verify, 1 },
+	{ NULL, 0, NULL, 0 }
+    };
 
-    while ((opt = getopt(argc, argv, "vhkf:o:b:r:z:")) != -1) {
+    while ((opt = getopt_long(argc, argv,
+			      "vhkmdeBCPIl:j:f:o:b:r:z:S:L:T:R:D:U:",
+			      long_options, NULL)) != -1) {
 	switch(opt) {
+	case 0:  // long option flag
+	    break;
 	case 'h':
 	    usage();
 	    break;
@@ -404,6 +2484,65 @@ int main(char argc, char *argv[])
 	case 'k':
 	    konv = 1;
 	    break;
+	case 'e':
+	    exact = 1;
+	    break;
+	case 'L':
+	    leader = strtol(optarg, &ptr, 10);
+	    gap = (*ptr == ',') ? atoi(ptr+1) : leader;
+	    if ((leader < 1) || (leader > MAX_LEADER) ||
+		(gap < 1) || (gap > MAX_LEADER))
+		usage();
+	    check = 1;
+	    break;
+	case 'S':
+	    stats_filename = optarg;
+	    break;
+	case 'm':
+	    memory_output = 1;
+	    break;
+	case 'd':
+	    decode = 1;
+	    break;
+	case 'B':
+	    batch_mode = 1;
+	    break;
+	case 'C':
+	    channels = 1;
+	    break;
+	case 'P':
+	    pipeline = 1;
+	    break;
+	case 'R':
+	    if ((lookahead_ms = atoi(optarg)) < 1)
+		usage();
+	    pipeline = 1;
+	    break;
+	case 'I':
+	    incremental = 1;
+	    break;
+	case 'D':
+	    daemon_path = optarg;
+	    break;
+	case 'U':
+	    remote_path = optarg;
+	    break;
+	case 'T':
+	    if ((gap_ms = atoi(optarg)) < 0)
+		usage();
+	    image = 1;
+	    break;
+	case 'l':
+	    manifest = optarg;
+	    batch_mode = 1;
+	    break;
+	case 'j':
+	    jobs = atoi(optarg);
+	    if (jobs < 0)
+		usage();
+	    if (jobs == 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	    break;
 	case 'r':
 	    rate0 = atoi(optarg);
 	    if (rate0 < 1400)
@@ -425,6 +2564,7 @@ int main(char argc, char *argv[])
 	    baud = atoi(optarg);
 	    if ((baud != 700) && (baud != 2400))
 		usage();
+	    baud_given = 1;
 	    break;
 	case 'f':
 	    if (strcmp(optarg, "wav") == 0)
@@ -433,6 +2573,8 @@ int main(char argc, char *argv[])
 		audio_format = AUDIO_FORMAT_AU;
 	    else if (strcmp(optarg, "raw") == 0)
 		audio_format = AUDIO_FORMAT_RAW;
+	    else if (strcmp(optarg, "flac") == 0)
+		audio_format = AUDIO_FORMAT_FLAC;
 	    else
 		usage();
 	    break;
@@ -450,196 +2592,161 @@ int main(char argc, char *argv[])
 	}
     }
 
-    br = (rate0+baud-1)/baud;
-    if (br & 1) br++;           // make even
-    hbitsz = br/2;              // half bit size
-    bitsz  = hbitsz*2;          // bitsize
-    sample_rate = br*baud;      // adjust rate
+    if (decode) {
+	if (optind < argc) {
+	    input_filename = argv[optind];
+	    if ((fin = fopen(input_filename, "rb")) == NULL) {
+		fprintf(stderr, "%s: unable to open file %s (%s)\n",
+			progname, input_filename, strerror(errno));
+		exit(1);
+	    }
+	}
+	exit(decode_file(fin, output_filename, konv, rate0,
+			 bits_per_channel, baud_given));
+    }
 
-    if (output_filename != NULL) {
+    if (daemon_path != NULL)  // -o is the cache directory
+	exit(run_daemon(daemon_path, output_filename));
+
+    if ((output_filename != NULL) && !batch_mode) {
 	if ((ptr = strrchr(output_filename, '.')) != NULL) {
 	    if (audio_format == AUDIO_FORMAT_UNDEF) { // from file extension
 		if (strcasecmp(ptr, ".wav") == 0)
 		    audio_format = AUDIO_FORMAT_WAV;
 		else if (strcasecmp(ptr, ".au") == 0)
 		    audio_format = AUDIO_FORMAT_AU;
+		else if (strcasecmp(ptr, ".flac") == 0)
+		    audio_format = AUDIO_FORMAT_FLAC;
 		else
 		    audio_format = AUDIO_FORMAT_RAW;
 	    }
 	}
-	if ((ptr == NULL) || ((fptr = strrchr(ptr, '/')) == NULL))
-	    fptr = output_filename;
-	else
-	    fptr++;
     }
     if (audio_format == AUDIO_FORMAT_UNDEF)
 	audio_format = DEFAULT_AUDIO_FORMAT;
+    // flac frames are built from the edges of one stream of blocks
+    if ((audio_format == AUDIO_FORMAT_FLAC) &&
+	(exact || memory_output || channels || image ||
+	 ((jobs > 1) && !batch_mode))) {
+	fprintf(stderr, "%s: flac can not be used with -e, -m, -j, -C or -T\n",
+		progname);
+	exit(1);
+    }
 
-    if (optind < argc) {
-	input_filename = argv[optind];
-	if ((ptr = strrchr(input_filename, '.')) != NULL) {
-	    if (strcasecmp(ptr, ".bas") == 0) {
-		memcpy(ext, "BAS", 3);
-		konv = 1;
-	    }
-	    else if (strcasecmp(ptr, ".bac") == 0)
-		memcpy(ext, "BAC", 3);
-	    else {
-		memcpy(ext, "BAC", 3);  // default!
-		konv = 1;
-	    }
-	}
-	if ((ptr == NULL) || ((fptr = strrchr(ptr, '/')) == NULL))
-	    fptr = argv[optind];
-	else
-	    fptr++;
-	// set casette file name from real filename
-	memset(name, ' ', 8);
-	for (i = 0; (fptr[i] != '.') && (i < 8); i++)
-	    name[i] = toupper(fptr[i]);
-	if ((fin=fopen(input_filename,"rb")) == NULL) {
-	    fprintf(stderr, "%s: unable to open file %s (%s)\n",
-		    progname, input_filename, strerror(errno));
+    // the stages of one stream of blocks to a file or a pipe
+    if (pipeline &&
+	(memory_output || (jobs > 1) || batch_mode || channels || image)) {
+	fprintf(stderr, "%s: -P and -R can not be used with -m, -j, -B, -C "
+		"or -T\n", progname);
+	exit(1);
+    }
+    if (remote_path != NULL) {
+	job_t job;
+
+	if (memory_output || (jobs > 1) || batch_mode || channels || image ||
+	    pipeline || leader || verify) {
+	    fprintf(stderr, "%s: -U only goes with -b, -r, -f, -z, -k and "
+		    "-e\n", progname);
 	    exit(1);
 	}
+	memset(&job, 0, sizeof(job));
+	strcpy(job.name, "-");
+	job.baud = baud;
+	job.rate = rate0;
+	job.format = audio_format;
+	job.bits = bits_per_channel;
+	job.konv = konv;
+	job.exact = exact;
+	exit(encode_remote(remote_path, (optind < argc) ? argv[optind] : NULL,
+			   output_filename, &job));
     }
-
-    if (output_filename != NULL) {
-	fout = fopen(output_filename,"wb");
+    // blocks are patched in place, each has its own sample range
+    if (incremental &&
+	((output_filename == NULL) || exact ||
+	 (audio_format == AUDIO_FORMAT_FLAC) || memory_output ||
+	 (jobs > 1) || batch_mode || channels || image || pipeline)) {
+	fprintf(stderr, "%s: -I needs -o and a wav, au or raw output, not "
+		"-e, -m, -j, -B, -C, -T, -P or -R\n", progname);
+	exit(1);
+    }
+    // the samples are read at the bit times of one stream of blocks
+    if (verify &&
+	((audio_format == AUDIO_FORMAT_FLAC) || channels || image)) {
+	fprintf(stderr, "%s: --verify needs a wav, au or raw output, not "
+		"-C or -T\n", progname);
+	exit(1);
+    }
+    // the pace is in bytes, flac frames vary in size
+    if (lookahead_ms && (audio_format == AUDIO_FORMAT_FLAC)) {
+	fprintf(stderr, "%s: -R can not pace flac output\n", progname);
+	exit(1);
     }
 
-    frame_size = (bits_per_channel*DEFAULT_NUM_CHANNELS+7)/8;
+    if (exact)
+	r = abc_encoder_init_exact(&enc, audio_format, bits_per_channel,
+				   baud, rate0);
+    else
+	r = abc_encoder_init(&enc, audio_format, bits_per_channel,
+			     baud, rate0);
+    if (r < 0) {
+	if (errno == ERANGE)
+	    fprintf(stderr, "rate / baud out of range\n");
+	else
+	    fprintf(stderr, "%s: unable to initialize encoder (%s)\n",
+		    progname, strerror(errno));
+	exit(1);
+    }
+    if (leader)
+	abc_encoder_set_leader(&enc, leader, gap);
 
     if (verbose) {
 	fprintf(stderr, "%s: baud=%d, rate'=%d, rate=%d\n",
-		progname, baud, rate0, sample_rate);
-	fprintf(stderr, "         input_filename = %s\n", input_filename);
-	fprintf(stderr, "         output_filename = %s\n", output_filename);
-	fprintf(stderr, "         cassete name = %.8s.%s\n", name, ext);
+		progname, baud, rate0, enc.sample_rate);
 	fprintf(stderr, "         audio_format = %d\n", audio_format);
-	fprintf(stderr, "         bitsz=%d, hbitsz=%d\n", bitsz, hbitsz);
-	fprintf(stderr, "         frame_size = %d\n", frame_size);
-    }
-    
-    if ((hbitsz < 1) || (hbitsz > MAX_HBITSZ)) {
-	fprintf(stderr, "rate / baud out of range\n");
-	exit(1);
+	fprintf(stderr, "         bitsz=%d, hbitsz=%d\n",
+		enc.bitsz, enc.hbitsz);
+	fprintf(stderr, "         frame_size = %d\n", enc.frame_size);
     }
 
-    switch(audio_format) {
-    case AUDIO_FORMAT_WAV:
-	switch(bits_per_channel) {
-	case 8:  // u8
-	    wl.u8 = (uint8_t)(LOW_LEVEL*0x7f)+0x80;
-	    wh.u8 = (uint8_t)(HIGH_LEVEL*0x7f)+0x80;
-	    break;
-	case 16:  // s16_le
-	    wl.u16 = (uint16_t)(LOW_LEVEL*0x7fff);
-	    wh.u16 = (uint16_t)(HIGH_LEVEL*0x7fff);
-	    little16(&wl.u16);
-	    little16(&wh.u16);
-	    break;
-	case 24:
-	    wl.u32 = ((uint32_t)(LOW_LEVEL*0x7fffffff)) << 8;
-	    wh.u32 = ((uint32_t)(HIGH_LEVEL*0x7fffffff)) << 8;
-	    little32(&wl.u32);
-	    little32(&wh.u32);	    
-	    break;
-	case 32:  // s16_le
-	    wl.u32 = (uint32_t)(LOW_LEVEL*0x7fffffff);
-	    wh.u32 = (uint32_t)(HIGH_LEVEL*0x7fffffff);
-	    little32(&wl.u32);
-	    little32(&wh.u32);
-	    break;	    
+    memset(&stats, 0, sizeof(stats));
+    if (channels || image) {
+	r = encode_files(&enc, argc - optind, argv + optind,
+			 output_filename, konv, channels, gap_ms, &stats);
+    }
+    else if (batch_mode) {
+	// -o is the output directory
+	memset(&batch, 0, sizeof(batch));
+	batch.enc = &enc;
+	batch.konv = konv;
+	batch.memory_output = memory_output;
+	if (stats_filename != NULL) {
+	    batch.stats = &stats;
+	    pthread_mutex_init(&batch.lock, NULL);
 	}
-	break;
-    case AUDIO_FORMAT_AU:
-    default:
-	switch(bits_per_channel) {
-	case 8:  // u8
-	    wl.u8 = (uint8_t)(LOW_LEVEL*0x7f)+0x80;
-	    wh.u8 = (uint8_t)(HIGH_LEVEL*0x7f)+0x80;	    
-	    // wl.u8 = (uint8_t)(LOW_LEVEL*0x7f);
-	    // wh.u8 = (uint8_t)(HIGH_LEVEL*0x7f);
-	    break;
-	case 16: // s16_be
-	    wl.u16 = (uint16_t)(LOW_LEVEL*0x7fff);
-	    wh.u16 = (uint16_t)(HIGH_LEVEL*0x7fff);
-	    big16(&wl.u16);
-	    big16(&wh.u16);
-	    break;
-	case 24:  // s24_be
-	    wl.u32 = ((uint32_t)(LOW_LEVEL*0x7fffffff)) << 8;
-	    wh.u32 = ((uint32_t)(HIGH_LEVEL*0x7fffffff)) << 8;
-	    big32(&wl.u32);
-	    big32(&wh.u32);
-	    break;
-	case 32:  // s32_be
-	    wl.u32 = (uint32_t)(LOW_LEVEL*0x7fffffff);
-	    wh.u32 = (uint32_t)(HIGH_LEVEL*0x7fffffff);
-	    big32(&wl.u32);
-	    big32(&wh.u32);
-	    break;  	    
-	}
-	break;
-    }
-    
-    init_bits(&bit_state, bits_per_channel, wl, wh);
-
-    // read the file into a buffer
-    if ((audio_format == AUDIO_FORMAT_WAV) && (filelen == -1)) {
-	char filebuf[64*1024];
-	
-	filelen = fread(filebuf, sizeof(char), sizeof(filebuf), fin);
-	if (verbose)
-	    fprintf(stderr, "input filelen = %d\n", filelen);
-	if (konv)
-	    filelen = konvert_line(filebuf, filelen);
-	numblk=filelen / 253;
-	if (filelen % 253) numblk++;    // if not exact add block
-	numblk++;                       // add one for name block
-	// number of samples(frames) in audio file
-	numsamp = numblk*(32+3+1+256+1+2)*8*bitsz;
-	numbyte = numsamp*frame_size;
-
-	if (verbose)
-	    fprintf(stderr, "Size:%d Blk:%d Byte:%d Samp:%d\n",
-		    filelen,numblk,numbyte,numsamp);
-	if (audio_format == AUDIO_FORMAT_WAV)
-	    write_wav(fout,numsamp,bits_per_channel,DEFAULT_NUM_CHANNELS);
-	else if (audio_format == AUDIO_FORMAT_AU)
-	    write_au(fout,numsamp,bits_per_channel,DEFAULT_NUM_CHANNELS);
-	else
-	    ;
-	transmit_name_block(fout);
-	transmit_data_blocks(filebuf, filelen, fout);
+	if (manifest != NULL)
+	    read_manifest(&batch, manifest, output_filename);
+	for (; optind < argc; optind++)
+	    add_batch_file(&batch, argv[optind],
+			   batch_output_name(argv[optind], output_filename,
+					     audio_format));
+	r = encode_batch(&batch, jobs);
+	stats.wall = abc_now() - wall0;  // files overlap
     }
     else {
-	char blkbuf[253];	
-	size_t len;
-	int cnt = 0;
-
-	if (audio_format == AUDIO_FORMAT_WAV)
-	    write_wav(fout,-1,bits_per_channel,DEFAULT_NUM_CHANNELS);
-	else if (audio_format == AUDIO_FORMAT_AU)
-	    write_au(fout,-1,bits_per_channel,DEFAULT_NUM_CHANNELS);
+	if (jobs > 1)
+	    memory_output = 1;  // blocks are rendered into their offsets
+	if (optind < argc)
+	    input_filename = argv[optind];
 	else
-	    ;
-	transmit_name_block(fout);
-
-	filelen = 0;
-	while ((len = fread(blkbuf, sizeof(char), sizeof(blkbuf), fin))) {
-	    if (konv)
-		len = konvert_line(blkbuf, len);
-	    transmit_data_block(cnt++, blkbuf, len, fout);
-	    filelen += len;
-	}
-	if (verbose)
-	    fprintf(stderr, "input filelen = %d\n", filelen);
+	    input_filename = NULL;
+	if (incremental)
+	    r = encode_incremental(&enc, input_filename, output_filename,
+				   konv, stats_filename ? &stats : NULL);
+	else
+	    r = encode_file(&enc, input_filename, output_filename, konv,
+			    memory_output, jobs, stats_filename ? &stats : NULL);
     }
-    if (fout != stdout)
-	fclose(fout);
-    if (fin != stdin)
-	fclose(fin);
-    exit(0);
+    if (stats_filename != NULL)
+	write_stats(stats_filename, &stats);
+    exit(r);
 }
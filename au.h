@@ -42,6 +42,19 @@ static inline int write_au_header(FILE* f, au_header_t* ptr)
 	   4 + (ptr->data_offset - sizeof(au_header_t)), f); 
 }
 
+static inline uint8_t* put_au_header(uint8_t* ptr, au_header_t* hdr)
+{
+    size_t n = 4 + (hdr->data_offset - sizeof(au_header_t));
+    ptr = put_u32be(ptr, hdr->magic);
+    ptr = put_u32be(ptr, hdr->data_offset);
+    ptr = put_u32be(ptr, hdr->data_size);
+    ptr = put_u32be(ptr, hdr->encoding);
+    ptr = put_u32be(ptr, hdr->sample_rate);
+    ptr = put_u32be(ptr, hdr->channels);
+    memcpy(ptr, hdr->annot, n);
+    return ptr+n;
+}
+
 #endif
 
 
@@ -0,0 +1,142 @@
+#ifndef __FLAC_H__
+#define __FLAC_H__
+
+#include <stdint.h>
+
+#define FLAC_MAGIC ((uint32_t) 0x664c6143)  // "fLaC"
+
+#define FLAC_METADATA_STREAMINFO 0
+#define FLAC_METADATA_LAST       0x80
+#define FLAC_STREAMINFO_SIZE     34
+
+// frame header, 14 bit sync code, variable block size
+#define FLAC_SYNC_VARIABLE  ((uint16_t) 0xfff9)
+#define FLAC_BLOCKSIZE_8    0x6     // 8 bit (blocksize-1) at header end
+#define FLAC_BLOCKSIZE_16   0x7     // 16 bit (blocksize-1) at header end
+#define FLAC_RATE_STREAMINFO  0x0
+#define FLAC_CHANNEL_MONO     0x0
+#define FLAC_BITS_STREAMINFO  0x0
+
+// subframe types (already shifted past the zero pad bit)
+#define FLAC_SUBFRAME_CONSTANT 0x00
+#define FLAC_SUBFRAME_VERBATIM 0x02
+#define FLAC_SUBFRAME_FIXED    0x10  // | order << 1
+
+#define FLAC_RESIDUAL_RICE2    1     // 5 bit rice parameters
+#define FLAC_RICE2_MAX_PARAM   30    // 31 is the escape code
+#define FLAC_MAX_PARTITION_ORDER 8
+
+typedef struct
+{
+    uint16_t min_blocksize;
+    uint16_t max_blocksize;
+    uint32_t min_framesize;   // 24 bit, 0 = unknown
+    uint32_t max_framesize;   // 24 bit, 0 = unknown
+    uint32_t sample_rate;     // 20 bit
+    uint8_t  channels;
+    uint8_t  bits_per_sample;
+    uint64_t total_samples;   // 36 bit, 0 = unknown
+    uint8_t  md5[16];         // zero = not computed
+} flac_streaminfo_t;
+
+// "fLaC" and the STREAMINFO block as the only metadata block
+static inline uint8_t* put_flac_streaminfo(uint8_t* ptr, flac_streaminfo_t* si)
+{
+    uint64_t x;
+
+    ptr = put_u32be(ptr, FLAC_MAGIC);
+    ptr = put_u32be(ptr, ((FLAC_METADATA_LAST|FLAC_METADATA_STREAMINFO)
+			  << 24) | FLAC_STREAMINFO_SIZE);
+    ptr = put_u16be(ptr, si->min_blocksize);
+    ptr = put_u16be(ptr, si->max_blocksize);
+    ptr = put_u24be(ptr, si->min_framesize);
+    ptr = put_u24be(ptr, si->max_framesize);
+    // rate:20 channels-1:3 bits-1:5 total:36
+    x = ((uint64_t) si->sample_rate << 44) |
+	((uint64_t) (si->channels-1) << 41) |
+	((uint64_t) (si->bits_per_sample-1) << 36) |
+	(si->total_samples & 0xfffffffffULL);
+    ptr = put_u32be(ptr, x >> 32);
+    ptr = put_u32be(ptr, x);
+    memcpy(ptr, si->md5, 16);
+    return ptr+16;
+}
+
+// crc-8 of the frame header, x^8 + x^2 + x + 1, a nibble at a time
+static inline uint8_t flac_crc8(const uint8_t* ptr, size_t len)
+{
+    static const uint8_t t[16] = {
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+	0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d };
+    uint8_t crc = 0;
+
+    while(len--) {
+	crc ^= *ptr++;
+	crc = (crc << 4) ^ t[crc >> 4];
+	crc = (crc << 4) ^ t[crc >> 4];
+    }
+    return crc;
+}
+
+// crc-16 of the whole frame, x^16 + x^15 + x^2 + 1
+static inline uint16_t flac_crc16(const uint8_t* ptr, size_t len)
+{
+    static const uint16_t t[16] = {
+	0x0000, 0x8005, 0x800f, 0x000a, 0x801b, 0x001e, 0x0014, 0x8011,
+	0x8033, 0x0036, 0x003c, 0x8039, 0x0028, 0x802d, 0x8027, 0x0022 };
+    uint16_t crc = 0;
+
+    while(len--) {
+	crc ^= (uint16_t) *ptr++ << 8;
+	crc = (crc << 4) ^ t[crc >> 12];
+	crc = (crc << 4) ^ t[crc >> 12];
+    }
+    return crc;
+}
+
+// msb first bit writer
+typedef struct
+{
+    uint8_t* ptr;
+    uint64_t acc;
+    int      nbits;  // bits in acc, less than 8 between calls
+} flac_bits_t;
+
+static inline void flac_put_bits(flac_bits_t* bw, uint32_t x, int n)
+{
+    if (n == 0)
+	return;
+    bw->acc = (bw->acc << n) | (x & (0xffffffffu >> (32-n)));
+    bw->nbits += n;
+    while(bw->nbits >= 8) {
+	bw->nbits -= 8;
+	*bw->ptr++ = bw->acc >> bw->nbits;
+    }
+}
+
+// zero pad to a byte boundary
+static inline uint8_t* flac_align(flac_bits_t* bw)
+{
+    if (bw->nbits > 0)
+	flac_put_bits(bw, 0, 8 - bw->nbits);
+    return bw->ptr;
+}
+
+// "utf-8" coded number, up to 36 bits in 7 bytes
+static inline uint8_t* put_flac_number(uint8_t* ptr, uint64_t x)
+{
+    int n, i;
+
+    if (x < 0x80) {
+	*ptr++ = x;
+	return ptr;
+    }
+    for (n = 2; (n < 7) && (x >= (1ULL << (5*n+1))); n++)
+	;
+    *ptr++ = (0xff00 >> n) | (x >> (6*(n-1)));
+    for (i = n-2; i >= 0; i--)
+	*ptr++ = 0x80 | ((x >> (6*i)) & 0x3f);
+    return ptr;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Single producer single consumer byte ring. head and tail only grow,
+// the producer owns head and the consumer owns tail, the data moves
+// without a lock. A side that finds the ring full (or empty) sleeps on
+// cond, the other side only takes the lock when it sees a sleeper.
+// Either side may close the ring, the producer at end of data and the
+// consumer when it gives up.
+typedef struct {
+    uint8_t* buf;
+    size_t   size;       // power of two
+    size_t   head __attribute__((aligned(64)));  // bytes put
+    size_t   tail __attribute__((aligned(64)));  // bytes taken
+    int      closed __attribute__((aligned(64)));
+    int      sleeping[2];  // consumer, producer waits on cond
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} ring_t;
+
+static inline int ring_init(ring_t* r, size_t size)
+{
+    memset(r, 0, sizeof(ring_t));
+    if ((r->buf = malloc(size)) == NULL)
+	return -1;
+    r->size = size;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+    return 0;
+}
+
+static inline void ring_free(ring_t* r)
+{
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r->buf);
+    r->buf = NULL;
+}
+
+// bytes the producer (put) or the consumer may move now
+static inline size_t ring_count(ring_t* r, int put)
+{
+    if (put)
+	return r->size - (r->head - __atomic_load_n(&r->tail,
+						    __ATOMIC_SEQ_CST));
+    return __atomic_load_n(&r->head, __ATOMIC_SEQ_CST) - r->tail;
+}
+
+// wait until there is something to move, 0 = closed
+static inline size_t ring_wait(ring_t* r, int put)
+{
+    size_t n;
+
+    if ((n = ring_count(r, put)) > 0)
+	return n;
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->sleeping[put], 1, __ATOMIC_SEQ_CST);
+    while(((n = ring_count(r, put)) == 0) &&
+	  !__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST))
+	pthread_cond_wait(&r->cond, &r->lock);
+    __atomic_store_n(&r->sleeping[put], 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+// wake the other side, the producer after a take (put = 1)
+static inline void ring_wake(ring_t* r, int put)
+{
+    if (__atomic_load_n(&r->sleeping[put], __ATOMIC_SEQ_CST)) {
+	pthread_mutex_lock(&r->lock);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+    }
+}
+
+static inline void ring_close(ring_t* r)
+{
+    pthread_mutex_lock(&r->lock);
+    __atomic_store_n(&r->closed, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// producer, contiguous free space at *ptr, 0 when the consumer is gone
+static inline size_t ring_space(ring_t* r, uint8_t** ptr)
+{
+    size_t n = ring_wait(r, 1);
+    size_t h = r->head & (r->size-1);
+
+    if (__atomic_load_n(&r->closed, __ATOMIC_SEQ_CST))
+	return 0;
+    *ptr = r->buf + h;
+    return (n < r->size - h) ? n : r->size - h;
+}
+
+static inline void ring_put(ring_t* r, size_t n)
+{
+    __atomic_store_n(&r->head, r->head + n, __ATOMIC_SEQ_CST);
+    ring_wake(r, 0);
+}
+
+// consumer, contiguous data at *ptr, 0 when closed and empty
+static inline size_t ring_data(ring_t* r, uint8_t** ptr)
+{
+    size_t n = ring_wait(r, 0);
+    size_t t = r->tail & (r->size-1);
+
+    *ptr = r->buf + t;
+    return (n < r->size - t) ? n : r->size - t;
+}
+
+static inline void ring_take(ring_t* r, size_t n)
+{
+    __atomic_store_n(&r->tail, r->tail + n, __ATOMIC_SEQ_CST);
+    ring_wake(r, 1);
+}
+
+// copy all of len in, -1 (EPIPE) when the consumer is gone
+static inline int ring_write(ring_t* r, const void* ptr, size_t len)
+{
+    const uint8_t* p = ptr;
+    uint8_t* dst;
+    size_t n;
+
+    while(len > 0) {
+	if ((n = ring_space(r, &dst)) == 0) {
+	    errno = EPIPE;
+	    return -1;
+	}
+	if (n > len)
+	    n = len;
+	memcpy(dst, p, n);
+	ring_put(r, n);
+	p += n;
+	len -= n;
+    }
+    return 0;
+}
+
+// copy len out, less only at the end of data
+static inline size_t ring_read(ring_t* r, void* ptr, size_t len)
+{
+    uint8_t* p = ptr;
+    uint8_t* src;
+    size_t n, got = 0;
+
+    while(got < len) {
+	if ((n = ring_data(r, &src)) == 0)
+	    break;
+	if (n > len - got)
+	    n = len - got;
+	memcpy(p + got, src, n);
+	ring_take(r, n);
+	got += n;
+    }
+    return got;
+}
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stdint.h>
+#include <string.h>
+
+// SHA-256 (FIPS 180-4), used as the key of the render cache
+
+#define SHA256_SIZE 32
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;         // bytes hashed
+    uint8_t  buf[64];
+    size_t   fill;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+
+static inline void sha256_block(sha256_t* s, const uint8_t* p)
+{
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++, p += 4)
+	w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+	    ((uint32_t) p[2] << 8) | p[3];
+    for (i = 16; i < 64; i++)
+	w[i] = w[i-16] + w[i-7] +
+	    (SHA256_ROR(w[i-15], 7) ^ SHA256_ROR(w[i-15], 18) ^
+	     (w[i-15] >> 3)) +
+	    (SHA256_ROR(w[i-2], 17) ^ SHA256_ROR(w[i-2], 19) ^
+	     (w[i-2] >> 10));
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+    for (i = 0; i < 64; i++) {
+	t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) +
+	    ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+	t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) +
+	    ((a & b) ^ (a & c) ^ (b & c));
+	h = g; g = f; f = e; e = d + t1;
+	d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static inline void sha256_init(sha256_t* s)
+{
+    static const uint32_t h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+    memcpy(s->h, h0, sizeof(h0));
+    s->len = 0;
+    s->fill = 0;
+}
+
+static inline void sha256_update(sha256_t* s, const void* ptr, size_t len)
+{
+    const uint8_t* p = ptr;
+    size_t n;
+
+    s->len += len;
+    if (s->fill > 0) {
+	n = (len < 64 - s->fill) ? len : 64 - s->fill;
+	memcpy(s->buf + s->fill, p, n);
+	s->fill += n;
+	p += n;
+	len -= n;
+	if (s->fill < 64)
+	    return;
+	sha256_block(s, s->buf);
+	s->fill = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+	sha256_block(s, p);
+    memcpy(s->buf, p, len);
+    s->fill = len;
+}
+
+static inline void sha256_final(sha256_t* s, uint8_t* digest)
+{
+    uint64_t bits = s->len * 8;
+    int i;
+
+    s->buf[s->fill++] = 0x80;
+    if (s->fill > 56) {
+	memset(s->buf + s->fill, 0, 64 - s->fill);
+	sha256_block(s, s->buf);
+	s->fill = 0;
+    }
+    memset(s->buf + s->fill, 0, 56 - s->fill);
+    for (i = 0; i < 8; i++)
+	s->buf[56+i] = bits >> (56 - 8*i);
+    sha256_block(s, s->buf);
+    for (i = 0; i < 8; i++) {
+	digest[4*i]   = s->h[i] >> 24;
+	digest[4*i+1] = s->h[i] >> 16;
+	digest[4*i+2] = s->h[i] >> 8;
+	digest[4*i+3] = s->h[i];
+    }
+}
+
+#endif
@@ -18,9 +18,16 @@
 #define IFF_ID_2CBE ((uint32_t)0x74776f73) /* "twos" *//* AIFF-C data format */
 #define IFF_ID_2CLE ((uint32_t)0x736f7774) /* "sowt" *//* AIFF-C data format */
 #define WAV_ID_RIFF ((uint32_t)0x52494646) /* "RIFF" */
+#define WAV_ID_RF64 ((uint32_t)0x52463634) /* "RF64" */
+#define WAV_ID_DS64 ((uint32_t)0x64733634) /* "ds64" */
+#define WAV_ID_JUNK ((uint32_t)0x4a554e4b) /* "JUNK" */
 #define WAV_ID_WAVE ((uint32_t)0x57415645) /* "WAVE" */
 #define WAV_ID_FMT  ((uint32_t)0x666d7420)  /* "fmt " */
 #define WAV_ID_DATA ((uint32_t)0x64617461) /* "data" */
+#define WAV_ID_CUE  ((uint32_t)0x63756520) /* "cue " */
+#define WAV_ID_LIST ((uint32_t)0x4c495354) /* "LIST" */
+#define WAV_ID_ADTL ((uint32_t)0x6164746c) /* "adtl" */
+#define WAV_ID_LABL ((uint32_t)0x6c61626c) /* "labl" */
 
 #define WAVE_FORMAT_PCM        ((uint16_t)0x0001)
 #define WAVE_FORMAT_IEEE_FLOAT ((uint16_t)0x0003)
@@ -100,7 +107,7 @@ static inline void big32(void* data)
 static inline uint32_t read_u16le(FILE* f)
 {
     uint16_t x;
-    if (fread(&x, sizeof(x), 1, f) == sizeof(x)) {
+    if (fread(&x, sizeof(x), 1, f) == 1) {
 	little16((uint8_t*)&x);
 	return x;
     }
@@ -110,13 +117,23 @@ static inline uint32_t read_u16le(FILE* f)
 static inline uint32_t read_u32le(FILE* f)
 {
     uint32_t x;
-    if (fread(&x, sizeof(x), 1, f) == sizeof(x)) {
+    if (fread(&x, sizeof(x), 1, f) == 1) {
 	little32((uint8_t*)&x);
 	return x;
     }
     return 0;
 }
 
+static inline uint32_t read_u32be(FILE* f)
+{
+    uint32_t x;
+    if (fread(&x, sizeof(x), 1, f) == 1) {
+	big32((uint8_t*)&x);
+	return x;
+    }
+    return 0;
+}
+
 static inline int write_u32le(FILE* f, uint32_t x)
 {
     little32((uint8_t*)&x);
@@ -167,6 +184,57 @@ static inline int write_16be(FILE* f, int16_t x)
 }
 
 
+static inline uint8_t* put_u16le(uint8_t* ptr, uint16_t x)
+{
+    ptr[0] = x;
+    ptr[1] = x >> 8;
+    return ptr+2;
+}
+
+static inline uint8_t* put_u32le(uint8_t* ptr, uint32_t x)
+{
+    ptr[0] = x;
+    ptr[1] = x >> 8;
+    ptr[2] = x >> 16;
+    ptr[3] = x >> 24;
+    return ptr+4;
+}
+
+static inline uint8_t* put_u64le(uint8_t* ptr, uint64_t x)
+{
+    ptr = put_u32le(ptr, x);
+    return put_u32le(ptr, x >> 32);
+}
+
+static inline uint8_t* put_u16be(uint8_t* ptr, uint16_t x)
+{
+    ptr[0] = x >> 8;
+    ptr[1] = x;
+    return ptr+2;
+}
+
+static inline uint8_t* put_u24be(uint8_t* ptr, uint32_t x)
+{
+    ptr[0] = x >> 16;
+    ptr[1] = x >> 8;
+    ptr[2] = x;
+    return ptr+3;
+}
+
+static inline uint8_t* put_u32be(uint8_t* ptr, uint32_t x)
+{
+    ptr[0] = x >> 24;
+    ptr[1] = x >> 16;
+    ptr[2] = x >> 8;
+    ptr[3] = x;
+    return ptr+4;
+}
+
+static inline uint8_t* put_tag(uint8_t* ptr, uint32_t tag)
+{
+    return put_u32be(ptr, tag);
+}
+
 static inline void print_tag(FILE* f, uint32_t tag)
 {
     fprintf(f, "%c%c%c%c",
@@ -179,7 +247,7 @@ static inline void print_tag(FILE* f, uint32_t tag)
 static inline int read_tag(FILE* f, uint32_t* tag)
 {
     int n;
-    if ((n = fread(tag, sizeof(*tag), 1, f)) == 4) {
+    if ((n = fread(tag, sizeof(*tag), 1, f)) == 1) {
 	big32(tag);
     }
     return n;
@@ -202,4 +270,15 @@ static inline int write_wav_header(FILE* f, wav_header_t* ptr)
 }
 
 
+static inline uint8_t* put_wav_header(uint8_t* ptr, wav_header_t* hdr)
+{
+    ptr = put_u16le(ptr, hdr->AudioFormat);
+    ptr = put_u16le(ptr, hdr->NumChannels);
+    ptr = put_u32le(ptr, hdr->SampleRate);
+    ptr = put_u32le(ptr, hdr->ByteRate);
+    ptr = put_u16le(ptr, hdr->FrameSize);
+    ptr = put_u16le(ptr, hdr->BitsPerChannel);
+    return ptr;
+}
+
 #endif